@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -16,6 +17,25 @@
 #include <wchar.h>
 #include <locale.h>
 #include <stdarg.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <regex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#endif
 
 #define SLIT_VERSION "0.7.0"
 
@@ -30,43 +50,258 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    BACKTAB_KEY,    // Shift+Tab
+    PASTE_KEY,  // 括弧付き貼り付け (内容は E.paste)
+    NOTIFY_KEY  // 裏で動いているスレッド (検索・絞り込み) から通知が届いた
 };
 
+// 行末の改行コード (値はそのままバイト数になる)
+enum editorEol {
+    EOL_NONE = 0,   // 改行なし (ファイル末尾)
+    EOL_LF,
+    EOL_CRLF
+};
+
+// 編集の記録 (ジャーナル) の種類
+enum editorJournalType {
+    JR_STEP = 1,    // コマンドの区切り (元に戻す単位)
+    JR_SPLICE,      // 行内の範囲の置き換え
+    JR_INSROW,      // 行の挿入
+    JR_DELROW,      // 行の削除
+    JR_EOL,         // 改行コードの変更
+    JR_UNDO,        // 元に戻した
+    JR_REDO,        // やり直した
+    JR_SAVE         // 保存できた (保存したファイルの大きさとハッシュ、写しを取った位置)
+};
+
+// 編集済みの行はギャップバッファで持つ:
+// chars[0..gap) と chars[gap + (size - len)..size) が行の中身
 typedef struct erow {
-    int size;   
-    int len;    
-    char *chars;
+    int size;     // chars の確保サイズ
+    int len;      // 行の長さ (ギャップを除く)
+    char *chars;  // NULLなら未編集行 (元データの off バイト目を直接参照)
+    int gap;      // ギャップの開始位置
+    unsigned char eol;  // 元の改行コード (保存時にそのまま書き戻す)
+    unsigned char plain;    // 1なら表示可能なASCIIだけ (1バイト=1桁で数えてよい)
+    size_t off;   // 元データ内でのバイトオフセット
 } erow;
 
-struct editorConfig {
-    int cx, cy; // cxはバイトインデックス
-    int rx;     // rxはレンダリング上のインデックス（カラム位置）
-    int numrows;    
-    erow *row;      
-    char *filename; // NULLならパイプモード
-    struct termios orig_termios;
-    int tty_fd;     // ★制御用端末のファイルディスクリプタ
+// 行番号・行数。20億行を超えるファイルも扱えるよう64ビットで持つ
+typedef long long rownum;
+
+// 行ストアの葉に並べる 8 バイトの行記述子。
+// 下位1ビットが1なら未編集行をそのまま詰めたもの:
+//   [63..24] 元データ内のオフセット (40ビット) [23..4] 長さ (20ビット)
+//   [3] plain [2..1] 改行コード
+// 0ならアリーナ上の erow へのポインタ (編集した行や、詰めきれない長い行)
+typedef uint64_t rowdesc;
+#define ROW_PACKED 1
+#define ROW_LEN_BITS 20
+#define ROW_OFF_BITS 40
+
+// 1行の長さの上限。これより長い行は改行なしの行に分けて持つ (編集してもギャップ込みで int に収まる)
+#define ROW_MAX_LEN (1 << 30)
+
+// 行のアリーナ: 16バイトから 64KB までの2の冪の区分
+#define ARENA_CHUNK (1 << 20)
+#define ARENA_MIN_SHIFT 4
+#define ARENA_CLASSES 13
+
+// 伸びていくファイル (パイプの退避先、--follow で追うファイル) をmmapするときの予約サイズ。
+// ファイルより大きく予約しておけば、書き足された分は貼り直さなくてもそのまま見える
+#define MAP_RESERVE ((size_t)1 << (sizeof(size_t) >= 8 ? 40 : 30))
+
+// 表示カラム索引のチェックポイント: byte バイト目 (文字境界) はカラム col
+struct colmark {
+    int byte;
+    int col;
 };
+#define COLMARK_INTERVAL 256
 
-struct editorConfig E;
+// 欄モードで覚えておく1行分の欄の開始位置
+struct fieldcache {
+    rownum line;    // どの行の表か (-1なら空き)
+    unsigned gen;   // 作ったときの E.fields_gen
+    int n;          // 欄の数
+    int cap;
+    int *start;     // 欄 i は start[i] バイト目から。start[n] は番兵 (行の長さ+1)
+};
+#define FIELD_CACHE 64  // 欄の表を覚えておく行数 (行番号で振り分ける)
 
-void disableRawMode();
-char *editorPrompt(char *prompt);
+// --- 行ストア (行数付きB+木) ---
+// 葉に行記述子を最大 LS_LEAF_MAX 個並べ、内部ノードは子ごとの部分木の行数を持つ。
+// 行の挿入・削除・添字アクセスはいずれも O(log n) で、
+// Enterやバックスペースのたびに全行を memmove しなくて済む。
+#define LS_LEAF_MAX 128
+#define LS_FANOUT 32
+#define LS_MAXDEPTH 16
+
+typedef struct lsnode {
+    int leaf;   // 1なら葉
+    int n;      // 葉なら行数、内部ノードなら子の数
+    union {
+        rowdesc rows[LS_LEAF_MAX];
+        struct {
+            struct lsnode *child[LS_FANOUT];
+            rownum count[LS_FANOUT];    // 各子の部分木に含まれる行数
+        } in;
+    } u;
+} lsnode;
 
 // --- Append Buffer (for flicker-free rendering) ---
+// 容量を倍々で確保し、フレームごとに解放せず使い回す
 struct abuf {
     char *b;
     int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+struct editorConfig {
+    int cx;     // cxはバイトインデックス
+    rownum cy;
+    int rx;     // rxはレンダリング上のインデックス（カラム位置）
+    rownum numrows;
+    lsnode *root;       // 行ストアの根
+    lsnode *hint;       // 直前にアクセスした葉 (連続アクセス用キャッシュ)
+    rownum hint_start;  // hint の先頭行番号
+    char *arena_next;   // 行アリーナで切り出し中の塊の空き
+    char *arena_end;
+    void *arena_free[ARENA_CLASSES];    // 区分ごとの空きリスト
+    pthread_mutex_t arena_lock;     // 置換のワーカーからも確保する
+    char *filename; // NULLならパイプモード
+    char *map;      // 元データ: ファイルモードはmmap、パイプモードは受信バッファ
+    size_t maplen;
+    size_t mapcap;  // 受信バッファの確保サイズ (パイプモード)、mmapした大きさ (ファイルモード)
+    size_t mapbase; // E.map[0] の元データ上のオフセット (送出済みの分は詰めて捨てる)
+    rownum rowbase; // 標準出力へ送出済みの行数 (行番号表示用)
+    rownum window;  // カーソルより何行上まで手元に残すか (0なら自動送出しない)
+    size_t budget;  // 受信バッファの上限。超えた分は一時ファイルへ退避する (0なら無制限)
+    int spill_fd;   // 退避先の一時ファイル (unlink済み)
+    char *spill_map;    // 一時ファイルのmmap (受信に合わせて伸びるよう大きめに予約)
+    size_t spill_end;   // 元データのうち [0, spill_end) は一時ファイル側にある
+    int eol;        // 新しく作る行の改行コード (先頭行に合わせる)
+    int ncpu;       // 索引作成などに使うスレッド数
+    int index_cache;    // 大きなファイルの行索引をキャッシュするか
+    size_t nul_off;     // 最初に見つかったNULの位置 (SIZE_MAXならなし)
+    rownum bad_rows;    // 不正なUTF-8を含む行の数
+    rownum bad_line;    // そのうち最初の行 (0始まり)
+    int src_fd;     // mmapした元ファイル (保存時のコピー元。-1ならなし)
+    size_t scanned; // 索引化済みの位置 (これより後ろは行末が未着)
+    int stream_fd;  // 受信中の標準入力 (-1ならEOF済み)
+    int follow;     // --follow: ファイルへの追記を取り込み続ける (止めたら0)
+    int follow_fd;  // 追記の通知を受ける inotify (-1なら一定間隔で調べるだけ)
+    int follow_wd;  // inotify の監視 (-1ならなし)
+    unsigned long long dirty;   // 保存していない編集の数 (0なら保存済み)
+    char notice[48];    // 状態表示に添える知らせ (次のキー入力で消える)
+    char *journal_path; // 編集の記録を置くファイル (NULLなら一時ファイル)
+    int journal_fd;     // 編集の記録 (-1ならまだ作っていない)
+    size_t journal_end; // 記録を書き終えた位置
+    struct abuf journal_buf;    // まだ書いていない記録
+    size_t journal_unsynced;    // fdatasync していない記録のバイト数
+    long long journal_synced;   // 最後に fdatasync した時刻 (ミリ秒)
+    int journal_mute;   // 0より大きい間は記録しない (読み込み・元に戻す処理など)
+    int step_open;      // 今のコマンドの区切りを書いたら1
+    rownum step_cy;     // 今のコマンドを始めたときのカーソル位置
+    int step_cx;
+    int step_typing;    // 直前のキーが文字入力なら1 (続けて打った文字はまとめて元に戻す)
+    size_t *undo_steps; // コマンドごとの区切りの記録上の位置
+    size_t undo_n, undo_done, undo_cap; // 記録したコマンド数、そのうち元に戻していない数
+    pid_t save_pid;     // 裏で保存している子プロセス (-1ならなし、子プロセス自身では0)
+    int save_fd;        // 子プロセスからの進み具合の知らせ (子プロセス側では書く方)
+    size_t save_done;   // 子プロセスが書いたバイト数
+    size_t save_mark;   // 保存の写しを取ったときのジャーナルの位置
+    unsigned long long save_dirty;  // そのときの保存していない編集の数
+    int save_result;    // 最後に終わった保存の結果 (失敗なら-1)
+    int columns;        // --columns: 行を区切り文字で欄に分けて扱う
+    int col_delim;      // 欄の区切り文字 (0ならまだ決めていない)
+    struct fieldcache fields[FIELD_CACHE];  // 行ごとの欄の表
+    unsigned fields_gen;    // 行の挿入・削除で増やす (古い表は使わない)
+    struct fieldcache col_head; // 見出し行の欄の表
+    char *col_header;   // 送り出した見出し行の写し (NULLなら先頭行を見る)
+    int col_headerlen;
+    int col_last;       // 最後に求めたカーソルの欄
+    rownum goto_line;   // 受信待ちの開始行 (-1ならなし)
+    int key_field;  // キーへのジャンプで比べる欄 (1始まり、0なら行全体)
+    int key_delim;  // 欄の区切り文字 (0なら空白の並び)
+    int in_prompt;  // プロンプト入力中は受信による再描画を控える
+    char prompt_info[64];   // プロンプトの入力欄の後ろに添える文字列
+    rownum prompt_row;  // プロンプトの後ろに見せる行と位置 (-1ならなし)
+    int prompt_col;
+    int prompt_enter;       // 最後のプロンプトを Enter で閉じたら1 (ESCなら0)
+    struct searchjob *search;   // 実行中の検索 (NULLならなし)
+    int notify_pipe[2];     // 裏のスレッドからの通知用パイプ
+    int find_cx;            // 検索を始めたときのカーソル位置
+    rownum find_cy;
+    struct rowfilter *filter;   // 絞り込み中の一致行 (NULLなら絞り込みなし)
+    int coloff;     // 横スクロール量 (表示カラム単位)
+    rownum marks_line;  // 表示カラム索引の対象行 (-1なら無効)
+    int nmarks;
+    int marks_cap;
+    struct colmark *marks;
+    int screencols; // 端末の幅
+    volatile sig_atomic_t winch; // SIGWINCHを受けたら1
+    volatile sig_atomic_t map_lost; // 元ファイルが外で切り詰められて mmap の先が読めなかったら1
+    long pagesize;
+    struct abuf frame;   // これから描く行の内容
+    struct abuf painted; // 最後に描いた行の内容
+    int painted_cx;      // 最後に置いたカーソルのカラム
+    int painted_valid;   // 0なら次は行全体を描き直す
+    struct abuf ob;      // 端末へ送るエスケープシーケンスの組み立て用
+    char inbuf[4096];   // 端末からまとめて読んだキー入力
+    char *script;       // --script のキー入力 (NULLなら端末から読む)
+    size_t scriptlen, scriptpos;
+    int inlen, inpos;
+    char *paste;        // 貼り付けられたテキスト
+    size_t pastelen, pastecap;
+    struct termios orig_termios;
+    int tty_fd;     // ★制御用端末のファイルディスクリプタ
 };
 
-#define ABUF_INIT {NULL, 0}
+struct editorConfig E;
+
+void disableRawMode();
+void editorRefreshLine();
+void editorPaint(int cursor);
+void editorDrawRowSlice(struct abuf *ab, rownum at, int width);
+void editorMarksInvalidate(erow *row, int at);
+void editorFieldsInvalidate(rownum at);
+void editorFieldsReset();
+void editorColumnKeepHeader();
+int editorIsPlain(const char *s, size_t len);
+char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorDrawPrompt(const char *msg);
+void editorFilterInsert(rownum at);
+void editorFilterDelete(rownum at);
+void editorFilterExtend();
+void editorFilterRefresh();
+void editorFilterFinish();
+char *editorSearchSuspend(int *nlen, int *dir, rownum *origin);
+void editorSearchResume(char *needle, int nlen, int dir, rownum origin);
+void editorFilterUpdate(rownum at);
+void editorJournalSplice(rownum y, int col, const char *old, int oldlen, const char *s, int len);
+void editorJournalRow(int type, rownum y, int eol, const char *s, size_t len);
+void editorJournalEol(rownum y, int old, int eol);
+void editorJournalReset();
+int editorJournalOpen();
+void editorFilterMove(int key);
+int editorRowClean(erow *row);
+int editorReadKey();
+void die(const char *s);
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
-    if (new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 256;
+        while (cap < ab->len + len) cap *= 2;
+        char *new = realloc(ab->b, cap);
+        // 記録や保存の途中で黙って欠けると困るので、足りなければ終わる
+        if (new == NULL) die("realloc");
+        ab->b = new;
+        ab->cap = cap;
+    }
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
@@ -88,11 +323,41 @@ void handleSignal(int sig) {
     // 端末設定を復元
     disableRawMode();
 
+    // 書きそびれた編集の記録を残しておく (次に開いたときに取り戻せる)
+    if (E.journal_fd != -1 && E.journal_buf.len > 0) {
+        if (pwrite(E.journal_fd, E.journal_buf.b, E.journal_buf.len, E.journal_end) == -1) {}
+    }
+
     // デフォルトのハンドラに戻してシグナルを再送（正常な終了ステータスのため）
     signal(sig, SIG_DFL);
     raise(sig);
 }
 
+void handleWinch(int sig) {
+    (void)sig;
+    E.winch = 1;
+}
+
+// 元ファイルが外で切り詰められると、mmap の新しい終わりより後ろを読んだところで
+// SIGBUS になる。そのページから後ろを0のページで塞いで読み出しを続けさせ、
+// メインループで開き直す (editorSourceCheck)。保存はこの印があれば失敗にする。
+// E.map の外で起きたものは本来どおり落ちる
+void handleBus(int sig, siginfo_t *si, void *ctx) {
+    (void)ctx;
+    char *addr = si->si_addr;
+    if (E.map && addr >= E.map && addr < E.map + E.mapcap) {
+        char *page = E.map + (addr - E.map) / E.pagesize * E.pagesize;
+        int fd = open("/dev/zero", O_RDONLY);
+        if (fd != -1 && mmap(page, E.map + E.mapcap - page, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+            close(fd);
+            E.map_lost = 1;
+            return;
+        }
+        if (fd != -1) close(fd);
+    }
+    signal(sig, SIG_DFL);
+}
+
 void die(const char *s) {
     tty_write("\r\n", 2);
     perror(s);
@@ -101,6 +366,7 @@ void die(const char *s) {
 
 void disableRawMode() {
     if (E.tty_fd != -1) {
+        tty_write("\x1b[?2004l", 8); // 括弧付き貼り付けモード解除
         tcsetattr(E.tty_fd, TCSAFLUSH, &E.orig_termios);
     }
 }
@@ -119,6 +385,9 @@ void enableRawMode() {
     raw.c_cc[VTIME] = 0;
     
     if (tcsetattr(E.tty_fd, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    // 括弧付き貼り付けモード: 貼り付けは ESC[200~ ... ESC[201~ で囲まれて届く
+    tty_write("\x1b[?2004h", 8);
 }
 
 void registerSignalHandlers() {
@@ -131,8 +400,396 @@ void registerSignalHandlers() {
     sigaction(SIGTERM, &sa, NULL);
     sigaction(SIGHUP, &sa, NULL);
 
-    // SIGWINCHはとりあえず無視（または再描画が必要ならここに追加）
-    // 現状は1行編集なので大きな影響はない
+    // 端末サイズ変更。SA_RESTARTを付けないのでreadがEINTRで戻り、その場で再描画する
+    sa.sa_handler = handleWinch;
+    sigaction(SIGWINCH, &sa, NULL);
+}
+
+// スクリプト実行でも元ファイルを読むので、ファイルを開く前に張る
+void registerBusHandler() {
+    struct sigaction sa;
+    sa.sa_sigaction = handleBus;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+// 端末の幅を取得する (取れなければ80桁とみなす)
+void editorUpdateWindowSize() {
+    struct winsize ws;
+    E.winch = 0;
+    if (ioctl(E.tty_fd, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+        E.screencols = 80;
+    } else {
+        E.screencols = ws.ws_col;
+    }
+}
+
+// --- 行のアリーナ ---
+// 編集した行の erow と中身は1つずつ malloc せず、ARENA_CHUNK の塊から切り出す。
+// 大きさは2の冪に切り上げ、解放した分は区分ごとの空きリストで使い回す
+
+int editorArenaClass(size_t size) {
+    int c = 0;
+    while (((size_t)1 << (c + ARENA_MIN_SHIFT)) < size) c++;
+    return c;
+}
+
+// *size バイト以上を確保する。*size は実際に使える大きさに切り上げられる
+void *editorArenaAlloc(size_t *size) {
+    int c = editorArenaClass(*size);
+    if (c >= ARENA_CLASSES) {
+        void *p = malloc(*size);
+        if (!p) die("malloc");
+        return p;
+    }
+    size_t csize = (size_t)1 << (c + ARENA_MIN_SHIFT);
+    *size = csize;
+
+    pthread_mutex_lock(&E.arena_lock);
+    void *p = E.arena_free[c];
+    if (p) {
+        E.arena_free[c] = *(void **)p;
+    } else {
+        if ((size_t)(E.arena_end - E.arena_next) < csize) {
+            // 塊の残りは小さい区分の空きリストへ回してから次の塊へ移る
+            while (E.arena_end - E.arena_next >= (1 << ARENA_MIN_SHIFT)) {
+                int k = editorArenaClass(E.arena_end - E.arena_next + 1) - 1;
+                *(void **)E.arena_next = E.arena_free[k];
+                E.arena_free[k] = E.arena_next;
+                E.arena_next += (size_t)1 << (k + ARENA_MIN_SHIFT);
+            }
+            E.arena_next = malloc(ARENA_CHUNK);
+            if (!E.arena_next) die("malloc");
+            E.arena_end = E.arena_next + ARENA_CHUNK;
+        }
+        p = E.arena_next;
+        E.arena_next += csize;
+    }
+    pthread_mutex_unlock(&E.arena_lock);
+    return p;
+}
+
+// size は editorArenaAlloc が返した大きさ
+void editorArenaFree(void *p, size_t size) {
+    if (!p) return;
+    int c = editorArenaClass(size);
+    if (c >= ARENA_CLASSES) {
+        free(p);
+        return;
+    }
+    pthread_mutex_lock(&E.arena_lock);
+    *(void **)p = E.arena_free[c];
+    E.arena_free[c] = p;
+    pthread_mutex_unlock(&E.arena_lock);
+}
+
+// --- 行ストア操作 ---
+
+lsnode *lsNewNode(int leaf) {
+    lsnode *nd = malloc(sizeof(lsnode));
+    if (!nd) die("malloc");
+    nd->leaf = leaf;
+    nd->n = 0;
+    return nd;
+}
+
+rownum lsNodeRows(lsnode *nd) {
+    if (nd->leaf) return nd->n;
+    rownum total = 0;
+    for (int i = 0; i < nd->n; i++) total += nd->u.in.count[i];
+    return total;
+}
+
+// at行目を含む葉と、その先頭の行番号。hint を書き換えないので
+// 木を変更しない間はワーカースレッドからも呼べる
+lsnode *lsLeafFind(rownum at, rownum *start) {
+    lsnode *nd = E.root;
+    *start = 0;
+    while (!nd->leaf) {
+        int i = 0;
+        while (i < nd->n - 1 && at - *start >= nd->u.in.count[i]) {
+            *start += nd->u.in.count[i];
+            i++;
+        }
+        nd = nd->u.in.child[i];
+    }
+    return nd;
+}
+
+// 行記述子が指す行。詰めた記述子なら tmp に展開して返す (tmp を書き換えても行は変わらない)
+// 木には触れないのでワーカースレッドからも呼べる
+erow *editorRowDecode(rowdesc d, erow *tmp) {
+    if (!(d & ROW_PACKED)) return (erow *)(uintptr_t)d;
+    tmp->size = 0;
+    tmp->len = (d >> 4) & ((1 << ROW_LEN_BITS) - 1);
+    tmp->chars = NULL;
+    tmp->gap = 0;
+    tmp->eol = (d >> 1) & 3;
+    tmp->plain = (d >> 3) & 1;
+    tmp->off = d >> (64 - ROW_OFF_BITS);
+    return tmp;
+}
+
+// 行 r を記述子にする。詰められない行はアリーナに erow を作ってそのポインタを返す
+rowdesc editorRowEncode(const erow *r) {
+    if (!r->chars && (size_t)r->len < ((size_t)1 << ROW_LEN_BITS) &&
+        (uint64_t)r->off < (UINT64_C(1) << ROW_OFF_BITS))
+        return (uint64_t)r->off << (64 - ROW_OFF_BITS) | (uint64_t)r->len << 4 |
+               (uint64_t)r->plain << 3 | (uint64_t)r->eol << 1 | ROW_PACKED;
+    size_t size = sizeof(erow);
+    erow *heap = editorArenaAlloc(&size);
+    *heap = *r;
+    return (rowdesc)(uintptr_t)heap;
+}
+
+// at行目の記述子の置き場所
+rowdesc *editorRowSlot(rownum at) {
+    if (E.hint && at >= E.hint_start && at < E.hint_start + E.hint->n)
+        return &E.hint->u.rows[at - E.hint_start];
+
+    rownum start;
+    lsnode *nd = lsLeafFind(at, &start);
+    E.hint = nd;
+    E.hint_start = start;
+    return &nd->u.rows[at - start];
+}
+
+// at行目を読むだけのときに使う。詰めた行は tmp に展開する
+erow *editorRowGet(rownum at, erow *tmp) {
+    if (at < 0 || at >= E.numrows) return NULL;
+    return editorRowDecode(*editorRowSlot(at), tmp);
+}
+
+// at行目の erow を返す。書き換えられるよう詰めた行はアリーナの erow に移す。
+// 行の挿入・削除でポインタは無効になる
+erow *editorRowAt(rownum at) {
+    if (at < 0 || at >= E.numrows) return NULL;
+    rowdesc *d = editorRowSlot(at);
+    if (*d & ROW_PACKED) {
+        erow tmp;
+        size_t size = sizeof(erow);
+        erow *heap = editorArenaAlloc(&size);
+        *heap = *editorRowDecode(*d, &tmp);
+        *d = (rowdesc)(uintptr_t)heap;
+    }
+    return (erow *)(uintptr_t)*d;
+}
+
+void lsInsertRight(lsnode **path, int *idx, int depth, lsnode *left, lsnode *right);
+
+// 葉 nd の at 番目に行を入れる。path/idx は根からの経路 (カウントは加算済み)
+void lsLeafInsert(lsnode **path, int *idx, int depth, lsnode *nd, int at, rowdesc r) {
+    E.hint = NULL;
+    if (nd->n < LS_LEAF_MAX) {
+        memmove(&nd->u.rows[at + 1], &nd->u.rows[at], sizeof(rowdesc) * (nd->n - at));
+        nd->u.rows[at] = r;
+        nd->n++;
+        return;
+    }
+
+    // 葉の分割。末尾への追加なら新しい葉に1行だけ置いて、
+    // ファイル読み込みのような順次追加で葉が満杯のまま詰まるようにする
+    lsnode *right = lsNewNode(1);
+    if (at == nd->n) {
+        right->u.rows[0] = r;
+        right->n = 1;
+    } else {
+        int half = nd->n / 2;
+        memcpy(right->u.rows, &nd->u.rows[half], sizeof(rowdesc) * (nd->n - half));
+        right->n = nd->n - half;
+        nd->n = half;
+        lsnode *dst = (at <= half) ? nd : right;
+        int pos = (at <= half) ? at : at - half;
+        memmove(&dst->u.rows[pos + 1], &dst->u.rows[pos], sizeof(rowdesc) * (dst->n - pos));
+        dst->u.rows[pos] = r;
+        dst->n++;
+    }
+
+    lsInsertRight(path, idx, depth, nd, right);
+}
+
+// 分割で生まれた右ノード right を left の右隣として親へ登録していく
+void lsInsertRight(lsnode **path, int *idx, int depth, lsnode *left, lsnode *right) {
+    while (1) {
+        if (depth == 0) {
+            lsnode *root = lsNewNode(0);
+            root->n = 2;
+            root->u.in.child[0] = left;
+            root->u.in.count[0] = lsNodeRows(left);
+            root->u.in.child[1] = right;
+            root->u.in.count[1] = lsNodeRows(right);
+            E.root = root;
+            return;
+        }
+        depth--;
+        lsnode *parent = path[depth];
+        int i = idx[depth];
+        parent->u.in.count[i] = lsNodeRows(left);
+
+        if (parent->n < LS_FANOUT) {
+            memmove(&parent->u.in.child[i + 2], &parent->u.in.child[i + 1],
+                    sizeof(lsnode *) * (parent->n - i - 1));
+            memmove(&parent->u.in.count[i + 2], &parent->u.in.count[i + 1],
+                    sizeof(rownum) * (parent->n - i - 1));
+            parent->u.in.child[i + 1] = right;
+            parent->u.in.count[i + 1] = lsNodeRows(right);
+            parent->n++;
+            return;
+        }
+
+        // 親も満杯なので分割する
+        lsnode *child[LS_FANOUT + 1];
+        rownum count[LS_FANOUT + 1];
+        int n = parent->n + 1;
+        memcpy(child, parent->u.in.child, sizeof(lsnode *) * (i + 1));
+        memcpy(count, parent->u.in.count, sizeof(rownum) * (i + 1));
+        child[i + 1] = right;
+        count[i + 1] = lsNodeRows(right);
+        memcpy(&child[i + 2], &parent->u.in.child[i + 1], sizeof(lsnode *) * (parent->n - i - 1));
+        memcpy(&count[i + 2], &parent->u.in.count[i + 1], sizeof(rownum) * (parent->n - i - 1));
+
+        int keep = (i + 1 == parent->n) ? parent->n : n / 2;
+        lsnode *sibling = lsNewNode(0);
+        memcpy(parent->u.in.child, child, sizeof(lsnode *) * keep);
+        memcpy(parent->u.in.count, count, sizeof(rownum) * keep);
+        parent->n = keep;
+        memcpy(sibling->u.in.child, &child[keep], sizeof(lsnode *) * (n - keep));
+        memcpy(sibling->u.in.count, &count[keep], sizeof(rownum) * (n - keep));
+        sibling->n = n - keep;
+
+        left = parent;
+        right = sibling;
+    }
+}
+
+void lsInsert(rownum at, rowdesc r) {
+    lsnode *path[LS_MAXDEPTH];
+    int idx[LS_MAXDEPTH];
+    int depth = 0;
+    lsnode *nd = E.root;
+
+    while (!nd->leaf) {
+        int i = 0;
+        while (i < nd->n - 1 && at > nd->u.in.count[i]) {
+            at -= nd->u.in.count[i];
+            i++;
+        }
+        nd->u.in.count[i]++;
+        path[depth] = nd;
+        idx[depth] = i;
+        depth++;
+        nd = nd->u.in.child[i];
+    }
+    lsLeafInsert(path, idx, depth, nd, (int)at, r);
+}
+
+// 組み立て済みの葉を末尾へつなぐ (ファイル読み込み用)。右端の経路を辿るだけで済む。
+// 右端の葉に収まるなら行を移して leaf は解放する
+void lsAppendLeaf(lsnode *leaf) {
+    lsnode *path[LS_MAXDEPTH];
+    int idx[LS_MAXDEPTH];
+    int depth = 0;
+    lsnode *nd = E.root;
+
+    E.hint = NULL;
+    while (!nd->leaf) {
+        int i = nd->n - 1;
+        nd->u.in.count[i] += leaf->n;
+        path[depth] = nd;
+        idx[depth] = i;
+        depth++;
+        nd = nd->u.in.child[i];
+    }
+    if (nd->n + leaf->n <= LS_LEAF_MAX) {
+        memcpy(&nd->u.rows[nd->n], leaf->u.rows, sizeof(rowdesc) * leaf->n);
+        nd->n += leaf->n;
+        free(leaf);
+        return;
+    }
+    lsInsertRight(path, idx, depth, nd, leaf);
+}
+
+// at行目の記述子を取り除く (中身の解放は呼び出し側で行う)
+void lsDelete(rownum at) {
+    lsnode *path[LS_MAXDEPTH];
+    int idx[LS_MAXDEPTH];
+    int depth = 0;
+    lsnode *nd = E.root;
+
+    E.hint = NULL;
+    while (!nd->leaf) {
+        int i = 0;
+        while (i < nd->n - 1 && at >= nd->u.in.count[i]) {
+            at -= nd->u.in.count[i];
+            i++;
+        }
+        nd->u.in.count[i]--;
+        path[depth] = nd;
+        idx[depth] = i;
+        depth++;
+        nd = nd->u.in.child[i];
+    }
+    memmove(&nd->u.rows[at], &nd->u.rows[at + 1], sizeof(rowdesc) * (nd->n - at - 1));
+    nd->n--;
+    if (depth == 0) return;
+
+    // 行が減った葉は隣の葉と併合できるなら併合する
+    lsnode *parent = path[depth - 1];
+    int i = idx[depth - 1];
+    if (nd->n < LS_LEAF_MAX / 4 && parent->n > 1) {
+        int j = (i + 1 < parent->n) ? i + 1 : i - 1;
+        lsnode *sib = parent->u.in.child[j];
+        if (sib->n + nd->n <= LS_LEAF_MAX) {
+            lsnode *l = (j > i) ? nd : sib;
+            lsnode *r = (j > i) ? sib : nd;
+            memcpy(&l->u.rows[l->n], r->u.rows, sizeof(rowdesc) * r->n);
+            l->n += r->n;
+            r->n = 0;
+            parent->u.in.count[j > i ? i : j] = l->n;
+            parent->u.in.count[j > i ? j : i] = 0;
+            nd = r;
+            i = (j > i) ? j : i;
+            idx[depth - 1] = i;
+        }
+    }
+
+    // 空になったノードは親から外す
+    while (nd->n == 0 && depth > 0) {
+        depth--;
+        parent = path[depth];
+        i = idx[depth];
+        free(nd);
+        memmove(&parent->u.in.child[i], &parent->u.in.child[i + 1],
+                sizeof(lsnode *) * (parent->n - i - 1));
+        memmove(&parent->u.in.count[i], &parent->u.in.count[i + 1],
+                sizeof(rownum) * (parent->n - i - 1));
+        parent->n--;
+        nd = parent;
+    }
+    if (E.root->n == 0 && !E.root->leaf) {
+        // 全行削除されたら空の葉に戻す
+        free(E.root);
+        E.root = lsNewNode(1);
+    }
+
+    // 子が1つだけの根は畳んで木を低くする
+    while (!E.root->leaf && E.root->n == 1) {
+        lsnode *old = E.root;
+        E.root = old->u.in.child[0];
+        free(old);
+    }
+}
+
+void editorFreeRow(rowdesc d);
+
+// nd 以下のノードと行をすべて解放する
+void lsFree(lsnode *nd) {
+    for (int i = 0; i < nd->n; i++) {
+        if (nd->leaf) editorFreeRow(nd->u.rows[i]);
+        else lsFree(nd->u.in.child[i]);
+    }
+    free(nd);
 }
 
 int is_utf8_continuation(char c) {
@@ -141,273 +798,4163 @@ int is_utf8_continuation(char c) {
 
 // --- 行操作 (v0.4と同じ) ---
 
-void editorInsertRow(int at, char *s, size_t len) {
+void editorInsertRow(rownum at, char *s, size_t len) {
     if (at < 0 || at > E.numrows) return;
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    E.row[at].size = len + 1;
-    E.row[at].len = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    editorJournalRow(JR_INSROW, at, E.eol, s, len);
+    erow row;
+    size_t size = len + 1;
+    row.chars = editorArenaAlloc(&size);
+    row.size = size;
+    row.len = len;
+    row.gap = len;
+    row.eol = E.eol;
+    row.plain = editorIsPlain(s, len);
+    row.off = 0;
+    memcpy(row.chars, s, len);
+    lsInsert(at, editorRowEncode(&row));
     E.numrows++;
+    E.dirty++;
+    if (E.marks_line >= at) E.marks_line++;
+    editorFieldsReset();
+    editorFilterInsert(at);
+}
+
+const char *editorEolChars(int eol) {
+    return eol == EOL_CRLF ? "\r\n" : eol == EOL_LF ? "\n" : "";
+}
+
+// 行 row の前後で改行して増やす行の改行コード (改行のない最終行なら既定のもの)
+int editorEolFor(erow *row) {
+    return row && row->eol != EOL_NONE ? row->eol : E.eol;
+}
+
+// 記述子 d の行が持っているアリーナの領域を返す
+void editorFreeRow(rowdesc d) {
+    if (d & ROW_PACKED) return;
+    erow *row = (erow *)(uintptr_t)d;
+    editorArenaFree(row->chars, row->size);
+    editorArenaFree(row, sizeof(erow));
+}
+
+// 元データの off バイト目へのポインタ
+char *editorSrc(size_t off) {
+    if (off < E.spill_end) return E.spill_map + off;
+    return E.map + (off - E.mapbase);
+}
+
+// ギャップを at へ移動する (移動距離に比例するコスト)
+void editorRowMoveGap(erow *row, int at) {
+    int gaplen = row->size - row->len;
+    if (at < row->gap) {
+        memmove(&row->chars[at + gaplen], &row->chars[at], row->gap - at);
+    } else if (at > row->gap) {
+        memmove(&row->chars[row->gap], &row->chars[row->gap + gaplen], at - row->gap);
+    }
+    row->gap = at;
+}
+
+// 行の中身へのポインタ。編集済みの行はギャップを行末へ寄せて連続にする
+// (未編集行はmmap領域を指すので、どちらの場合も'\0'終端されていない)
+char *editorRowChars(erow *row) {
+    if (!row->chars) return editorSrc(row->off);
+    editorRowMoveGap(row, row->len);
+    return row->chars;
+}
+
+// 行の中身をギャップの前後2つの区間として返す (ギャップは動かさない)
+void editorRowSpans(erow *row, const char **a, int *alen, const char **b, int *blen) {
+    if (!row->chars) {
+        *a = editorSrc(row->off);
+        *alen = row->len;
+        *b = NULL;
+        *blen = 0;
+        return;
+    }
+    *a = row->chars;
+    *alen = row->gap;
+    *b = &row->chars[row->gap + (row->size - row->len)];
+    *blen = row->len - row->gap;
+}
+
+// at番目のバイト
+char editorRowByte(erow *row, int at) {
+    if (!row->chars) return *editorSrc(row->off + at);
+    if (at >= row->gap) at += row->size - row->len;
+    return row->chars[at];
+}
+
+// 初めて編集される行をmmap領域から自前のヒープバッファへコピーする
+void editorRowMaterialize(erow *row) {
+    if (row->chars) return;
+    size_t size = row->len + row->len / 2 + 16;
+    row->chars = editorArenaAlloc(&size);
+    row->size = size;
+    memcpy(row->chars, editorSrc(row->off), row->len);
+    row->gap = row->len;
+}
+
+// ギャップを最低 need バイト確保する。容量は倍々で増やすので挿入は償却O(1)
+void editorRowReserve(erow *row, int need) {
+    if (row->size - row->len >= need) return;
+    int newsize = row->size < 16 ? 16 : row->size;
+    while (newsize - row->len < need) newsize *= 2;
+
+    int tail = row->len - row->gap;
+    size_t size = newsize;
+    char *chars = editorArenaAlloc(&size);
+    memcpy(chars, row->chars, row->gap);
+    memcpy(&chars[size - tail], &row->chars[row->size - tail], tail);
+    editorArenaFree(row->chars, row->size);
+    row->chars = chars;
+    row->size = size;
+}
+
+// 範囲挿入: y行目の at の位置に s[0..len) を入れる
+void editorRowInsertString(rownum y, int at, const char *s, int len) {
+    erow *row = editorRowAt(y);
+    if (!row) return;
+    if (at < 0 || at > row->len) at = row->len;
+    if (len <= 0) return;
+    editorJournalSplice(y, at, NULL, 0, s, len);
+    editorMarksInvalidate(row, at);
+    editorFieldsInvalidate(y);
+    editorRowMaterialize(row);
+    E.dirty++;
+    editorRowReserve(row, len);
+    editorRowMoveGap(row, at);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->len += len;
+    if (row->plain && !editorIsPlain(s, len)) row->plain = 0;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->chars);
+// 範囲削除: y行目の [at, at+len) を取り除く。ギャップを広げるだけなのでコピーは移動分のみ
+void editorRowDeleteRange(rownum y, int at, int len) {
+    erow *row = editorRowAt(y);
+    if (!row || at < 0 || at >= row->len || len <= 0) return;
+    if (len > row->len - at) len = row->len - at;
+    editorMarksInvalidate(row, at);
+    editorFieldsInvalidate(y);
+    editorRowMaterialize(row);
+    E.dirty++;
+    editorRowMoveGap(row, at);
+    // 消す部分はギャップの直後に連続している
+    editorJournalSplice(y, at, &row->chars[at + row->size - row->len], len, NULL, 0);
+    row->len -= len;
 }
 
-// バイトインデックス(cx)を画面上のカラム位置(rx)に変換
-// UTF-8文字幅を考慮
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
+// --- 文字幅 ---
+// libcの mbtowc/wcwidth はロケール処理が重いので、UTF-8を自前でデコードして
+// 静的な幅テーブルを二分探索する
+
+struct widthrange {
+    unsigned int first;
+    unsigned int last;
+};
+
+// 幅0の文字 (結合文字・書式制御文字など, Unicode 14.0.0)
+static const struct widthrange zero_width_table[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+    {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0600, 0x0605}, {0x0610, 0x061A}, {0x061C, 0x061C},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DD}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8},
+    {0x06EA, 0x06ED}, {0x070F, 0x070F}, {0x0711, 0x0711}, {0x0730, 0x074A}, {0x07A6, 0x07B0},
+    {0x07EB, 0x07F3}, {0x07FD, 0x07FD}, {0x0816, 0x0819}, {0x081B, 0x0823}, {0x0825, 0x0827},
+    {0x0829, 0x082D}, {0x0859, 0x085B}, {0x0890, 0x089F}, {0x08CA, 0x0902}, {0x093A, 0x093A},
+    {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963},
+    {0x0981, 0x0981}, {0x09BC, 0x09BC}, {0x09C1, 0x09C4}, {0x09CD, 0x09CD}, {0x09E2, 0x09E3},
+    {0x09FE, 0x0A02}, {0x0A3C, 0x0A3C}, {0x0A41, 0x0A51}, {0x0A70, 0x0A71}, {0x0A75, 0x0A75},
+    {0x0A81, 0x0A82}, {0x0ABC, 0x0ABC}, {0x0AC1, 0x0AC8}, {0x0ACD, 0x0ACD}, {0x0AE2, 0x0AE3},
+    {0x0AFA, 0x0B01}, {0x0B3C, 0x0B3C}, {0x0B3F, 0x0B3F}, {0x0B41, 0x0B44}, {0x0B4D, 0x0B56},
+    {0x0B62, 0x0B63}, {0x0B82, 0x0B82}, {0x0BC0, 0x0BC0}, {0x0BCD, 0x0BCD}, {0x0C00, 0x0C00},
+    {0x0C04, 0x0C04}, {0x0C3C, 0x0C3C}, {0x0C3E, 0x0C40}, {0x0C46, 0x0C56}, {0x0C62, 0x0C63},
+    {0x0C81, 0x0C81}, {0x0CBC, 0x0CBC}, {0x0CBF, 0x0CBF}, {0x0CC6, 0x0CC6}, {0x0CCC, 0x0CCD},
+    {0x0CE2, 0x0CE3}, {0x0D00, 0x0D01}, {0x0D3B, 0x0D3C}, {0x0D41, 0x0D44}, {0x0D4D, 0x0D4D},
+    {0x0D62, 0x0D63}, {0x0D81, 0x0D81}, {0x0DCA, 0x0DCA}, {0x0DD2, 0x0DD6}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC}, {0x0EC8, 0x0ECD},
+    {0x0F18, 0x0F19}, {0x0F35, 0x0F35}, {0x0F37, 0x0F37}, {0x0F39, 0x0F39}, {0x0F71, 0x0F7E},
+    {0x0F80, 0x0F84}, {0x0F86, 0x0F87}, {0x0F8D, 0x0FBC}, {0x0FC6, 0x0FC6}, {0x102D, 0x1030},
+    {0x1032, 0x1037}, {0x1039, 0x103A}, {0x103D, 0x103E}, {0x1058, 0x1059}, {0x105E, 0x1060},
+    {0x1071, 0x1074}, {0x1082, 0x1082}, {0x1085, 0x1086}, {0x108D, 0x108D}, {0x109D, 0x109D},
+    {0x1160, 0x11FF}, {0x135D, 0x135F}, {0x1712, 0x1714}, {0x1732, 0x1733}, {0x1752, 0x1753},
+    {0x1772, 0x1773}, {0x17B4, 0x17B5}, {0x17B7, 0x17BD}, {0x17C6, 0x17C6}, {0x17C9, 0x17D3},
+    {0x17DD, 0x17DD}, {0x180B, 0x180F}, {0x1885, 0x1886}, {0x18A9, 0x18A9}, {0x1920, 0x1922},
+    {0x1927, 0x1928}, {0x1932, 0x1932}, {0x1939, 0x193B}, {0x1A17, 0x1A18}, {0x1A1B, 0x1A1B},
+    {0x1A56, 0x1A56}, {0x1A58, 0x1A60}, {0x1A62, 0x1A62}, {0x1A65, 0x1A6C}, {0x1A73, 0x1A7F},
+    {0x1AB0, 0x1B03}, {0x1B34, 0x1B34}, {0x1B36, 0x1B3A}, {0x1B3C, 0x1B3C}, {0x1B42, 0x1B42},
+    {0x1B6B, 0x1B73}, {0x1B80, 0x1B81}, {0x1BA2, 0x1BA5}, {0x1BA8, 0x1BA9}, {0x1BAB, 0x1BAD},
+    {0x1BE6, 0x1BE6}, {0x1BE8, 0x1BE9}, {0x1BED, 0x1BED}, {0x1BEF, 0x1BF1}, {0x1C2C, 0x1C33},
+    {0x1C36, 0x1C37}, {0x1CD0, 0x1CD2}, {0x1CD4, 0x1CE0}, {0x1CE2, 0x1CE8}, {0x1CED, 0x1CED},
+    {0x1CF4, 0x1CF4}, {0x1CF8, 0x1CF9}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E},
+    {0x2060, 0x206F}, {0x20D0, 0x20F0}, {0x2CEF, 0x2CF1}, {0x2D7F, 0x2D7F}, {0x2DE0, 0x2DFF},
+    {0x302A, 0x302D}, {0x3099, 0x309A}, {0xA66F, 0xA672}, {0xA674, 0xA67D}, {0xA69E, 0xA69F},
+    {0xA6F0, 0xA6F1}, {0xA802, 0xA802}, {0xA806, 0xA806}, {0xA80B, 0xA80B}, {0xA825, 0xA826},
+    {0xA82C, 0xA82C}, {0xA8C4, 0xA8C5}, {0xA8E0, 0xA8F1}, {0xA8FF, 0xA8FF}, {0xA926, 0xA92D},
+    {0xA947, 0xA951}, {0xA980, 0xA982}, {0xA9B3, 0xA9B3}, {0xA9B6, 0xA9B9}, {0xA9BC, 0xA9BD},
+    {0xA9E5, 0xA9E5}, {0xAA29, 0xAA2E}, {0xAA31, 0xAA32}, {0xAA35, 0xAA36}, {0xAA43, 0xAA43},
+    {0xAA4C, 0xAA4C}, {0xAA7C, 0xAA7C}, {0xAAB0, 0xAAB0}, {0xAAB2, 0xAAB4}, {0xAAB7, 0xAAB8},
+    {0xAABE, 0xAABF}, {0xAAC1, 0xAAC1}, {0xAAEC, 0xAAED}, {0xAAF6, 0xAAF6}, {0xABE5, 0xABE5},
+    {0xABE8, 0xABE8}, {0xABED, 0xABED}, {0xFB1E, 0xFB1E}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF}, {0xFFF9, 0xFFFB}, {0x101FD, 0x101FD}, {0x102E0, 0x102E0}, {0x10376, 0x1037A},
+    {0x10A01, 0x10A0F}, {0x10A38, 0x10A3F}, {0x10AE5, 0x10AE6}, {0x10D24, 0x10D27},
+    {0x10EAB, 0x10EAC}, {0x10F46, 0x10F50}, {0x10F82, 0x10F85}, {0x11001, 0x11001},
+    {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074}, {0x1107F, 0x11081},
+    {0x110B3, 0x110B6}, {0x110B9, 0x110BA}, {0x110BD, 0x110BD}, {0x110C2, 0x110CD},
+    {0x11100, 0x11102}, {0x11127, 0x1112B}, {0x1112D, 0x11134}, {0x11173, 0x11173},
+    {0x11180, 0x11181}, {0x111B6, 0x111BE}, {0x111C9, 0x111CC}, {0x111CF, 0x111CF},
+    {0x1122F, 0x11231}, {0x11234, 0x11234}, {0x11236, 0x11237}, {0x1123E, 0x1123E},
+    {0x112DF, 0x112DF}, {0x112E3, 0x112EA}, {0x11300, 0x11301}, {0x1133B, 0x1133C},
+    {0x11340, 0x11340}, {0x11366, 0x11374}, {0x11438, 0x1143F}, {0x11442, 0x11444},
+    {0x11446, 0x11446}, {0x1145E, 0x1145E}, {0x114B3, 0x114B8}, {0x114BA, 0x114BA},
+    {0x114BF, 0x114C0}, {0x114C2, 0x114C3}, {0x115B2, 0x115B5}, {0x115BC, 0x115BD},
+    {0x115BF, 0x115C0}, {0x115DC, 0x115DD}, {0x11633, 0x1163A}, {0x1163D, 0x1163D},
+    {0x1163F, 0x11640}, {0x116AB, 0x116AB}, {0x116AD, 0x116AD}, {0x116B0, 0x116B5},
+    {0x116B7, 0x116B7}, {0x1171D, 0x1171F}, {0x11722, 0x11725}, {0x11727, 0x1172B},
+    {0x1182F, 0x11837}, {0x11839, 0x1183A}, {0x1193B, 0x1193C}, {0x1193E, 0x1193E},
+    {0x11943, 0x11943}, {0x119D4, 0x119DB}, {0x119E0, 0x119E0}, {0x11A01, 0x11A0A},
+    {0x11A33, 0x11A38}, {0x11A3B, 0x11A3E}, {0x11A47, 0x11A47}, {0x11A51, 0x11A56},
+    {0x11A59, 0x11A5B}, {0x11A8A, 0x11A96}, {0x11A98, 0x11A99}, {0x11C30, 0x11C3D},
+    {0x11C3F, 0x11C3F}, {0x11C92, 0x11CA7}, {0x11CAA, 0x11CB0}, {0x11CB2, 0x11CB3},
+    {0x11CB5, 0x11CB6}, {0x11D31, 0x11D45}, {0x11D47, 0x11D47}, {0x11D90, 0x11D91},
+    {0x11D95, 0x11D95}, {0x11D97, 0x11D97}, {0x11EF3, 0x11EF4}, {0x13430, 0x13438},
+    {0x16AF0, 0x16AF4}, {0x16B30, 0x16B36}, {0x16F4F, 0x16F4F}, {0x16F8F, 0x16F92},
+    {0x16FE4, 0x16FE4}, {0x1BC9D, 0x1BC9E}, {0x1BCA0, 0x1CF46}, {0x1D167, 0x1D169},
+    {0x1D173, 0x1D182}, {0x1D185, 0x1D18B}, {0x1D1AA, 0x1D1AD}, {0x1D242, 0x1D244},
+    {0x1DA00, 0x1DA36}, {0x1DA3B, 0x1DA6C}, {0x1DA75, 0x1DA75}, {0x1DA84, 0x1DA84},
+    {0x1DA9B, 0x1DAAF}, {0x1E000, 0x1E02A}, {0x1E130, 0x1E136}, {0x1E2AE, 0x1E2AE},
+    {0x1E2EC, 0x1E2EF}, {0x1E8D0, 0x1E8D6}, {0x1E944, 0x1E94A}, {0xE0001, 0xE01EF}
+};
+
+// 全角幅の文字 (East Asian Width が W / F)
+static const struct widthrange wide_table[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+    {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+    {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+    {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+    {0x2E80, 0x3029}, {0x302E, 0x303E}, {0x3041, 0x3096}, {0x309B, 0x3247}, {0x3250, 0x4DBF},
+    {0x4E00, 0xA4C6}, {0xA960, 0xA97C}, {0xAC00, 0xD7A3}, {0xF900, 0xFAD9}, {0xFE10, 0xFE19},
+    {0xFE30, 0xFE6B}, {0xFF01, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE3}, {0x16FF0, 0x1B2FB},
+    {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A},
+    {0x1F200, 0x1F320}, {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393},
+    {0x1F3A0, 0x1F3CA}, {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4},
+    {0x1F3F8, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D},
+    {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596},
+    {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC},
+    {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6DF}, {0x1F6EB, 0x1F6EC}, {0x1F6F4, 0x1F6FC},
+    {0x1F7E0, 0x1F7F0}, {0x1F90C, 0x1F93A}, {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF},
+    {0x1FA70, 0x1FAF6}, {0x20000, 0x3134A}
+};
+
+int widthTableHas(const struct widthrange *t, int n, unsigned int cp) {
+    if (cp < t[0].first || cp > t[n - 1].last) return 0;
+    int lo = 0, hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp > t[mid].last) lo = mid + 1;
+        else if (cp < t[mid].first) hi = mid - 1;
+        else return 1;
+    }
+    return 0;
+}
+
+// コードポイントの表示幅 (制御文字などは0幅扱い)
+int editorCharWidth(unsigned int cp) {
+    if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) return 0;
+    if (cp < 0x300) return 1;
+    if (widthTableHas(zero_width_table, sizeof(zero_width_table) / sizeof(zero_width_table[0]), cp))
+        return 0;
+    if (widthTableHas(wide_table, sizeof(wide_table) / sizeof(wide_table[0]), cp))
+        return 2;
+    return 1;
+}
+
+// s[0..n) の先頭の1文字をデコードしてバイト長を返し、表示幅を *width に入れる
+int editorDecodeChar(const char *s, int n, int *width) {
+    int char_len = 1;
+    // UTF-8のバイト長判定
+    unsigned char c = s[0];
+    unsigned int cp = c;
+    if (c < 0x80) {
+        *width = editorCharWidth(c);
+        return 1;
+    }
+    else if ((c & 0xE0) == 0xC0) { char_len = 2; cp = c & 0x1F; }
+    else if ((c & 0xF0) == 0xE0) { char_len = 3; cp = c & 0x0F; }
+    else if ((c & 0xF8) == 0xF0) { char_len = 4; cp = c & 0x07; }
+    // はみ出して読まない
+    if (char_len > n) char_len = n;
+
+    // 不正なシーケンスは1桁として扱う
+    *width = 1;
+    if (char_len == 1) return 1;
+    for (int k = 1; k < char_len; k++) {
+        if (!is_utf8_continuation(s[k])) return char_len;
+        cp = (cp << 6) | (s[k] & 0x3F);
+    }
+    *width = editorCharWidth(cp);
+    return char_len;
+}
+
+// 文字列の表示幅
+int editorStrWidth(const char *s, int len) {
+    int col = 0;
     int j = 0;
-    while (j < cx && j < row->len) {
-        int char_len = 1;
-        // UTF-8のバイト長判定
-        unsigned char c = row->chars[j];
-        if (c < 0x80) char_len = 1;
-        else if ((c & 0xE0) == 0xC0) char_len = 2;
-        else if ((c & 0xF0) == 0xE0) char_len = 3;
-        else if ((c & 0xF8) == 0xF0) char_len = 4;
+    while (j < len) {
+        int w;
+        j += editorDecodeChar(&s[j], len - j, &w);
+        col += w;
+    }
+    return col;
+}
+
+// j バイト目から始まる1文字のバイト長を返し、表示幅を *width に入れる
+int editorRowCharAt(erow *row, int j, int *width) {
+    unsigned char c = editorRowByte(row, j);
+    if (c < 0x80) {
+        *width = editorCharWidth(c);
+        return 1;
+    }
+    // ギャップをまたぐ可能性があるので一旦コピーする
+    char mb[4];
+    int n = row->len - j < 4 ? row->len - j : 4;
+    for (int k = 0; k < n; k++) mb[k] = editorRowByte(row, j + k);
+    return editorDecodeChar(mb, n, width);
+}
 
-        // 文字幅取得
-        wchar_t wc;
-        int width = 1;
-        if (mbtowc(&wc, &row->chars[j], char_len) > 0) {
-             width = wcwidth(wc);
-             if (width < 0) width = 0; // 制御文字などは0幅扱い
+// j バイト目から連続して読めるポインタと、その長さ (ギャップか行末まで)
+const unsigned char *editorRowPtr(erow *row, int j, int *avail) {
+    const char *a, *b;
+    int alen, blen;
+    editorRowSpans(row, &a, &alen, &b, &blen);
+    if (j < alen) {
+        *avail = alen - j;
+        return (const unsigned char *)&a[j];
+    }
+    *avail = alen + blen - j;
+    return (const unsigned char *)&b[j - alen];
+}
+
+// *pj バイト目 (カラム col) から to バイト目まで進めたときのカラムを返す
+// 表示可能なASCIIが続く区間は1バイト=1桁なので、SIMDで16バイトずつ読み飛ばす
+int editorRowAdvance(erow *row, int *pj, int col, int to) {
+    int j = *pj;
+    while (j < to) {
+        int avail;
+        const unsigned char *p = editorRowPtr(row, j, &avail);
+        if (avail > to - j) avail = to - j;
+#ifdef __SSE2__
+        const __m128i lo = _mm_set1_epi8(0x20);
+        const __m128i del = _mm_set1_epi8(0x7f);
+        while (avail >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            // 符号付き比較なので 0x80以上 も 0x20未満 と一緒に引っかかる
+            __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, lo), _mm_cmpeq_epi8(v, del));
+            if (_mm_movemask_epi8(special)) break;
+            p += 16;
+            j += 16;
+            col += 16;
+            avail -= 16;
+        }
+#endif
+        while (avail > 0 && *p >= 0x20 && *p < 0x7f) {
+            p++;
+            j++;
+            col++;
+            avail--;
         }
+        if (j >= to) break;
+        int w;
+        j += editorRowCharAt(row, j, &w);
+        col += w;
+    }
+    *pj = j;
+    return col;
+}
+
+// --- 表示カラム索引 ---
+// カーソル行について COLMARK_INTERVAL バイトごとに (バイト位置, カラム) を記録しておく。
+// cx→rx の変換は直前のチェックポイントからの走査だけで済み、長い行でも償却O(1)。
+// 行が編集されたら編集位置より後ろのチェックポイントだけを捨てる
+
+void editorMarksReset(rownum at) {
+    E.marks_line = at;
+    if (E.marks_cap == 0) {
+        E.marks_cap = 16;
+        E.marks = malloc(sizeof(struct colmark) * E.marks_cap);
+        if (!E.marks) die("malloc");
+    }
+    E.marks[0].byte = 0;
+    E.marks[0].col = 0;
+    E.nmarks = 1;
+}
+
+// チェックポイントを1つ先へ延ばす。行末に届いたら0を返す
+int editorMarksExtend(erow *row) {
+    struct colmark *last = &E.marks[E.nmarks - 1];
+    int target = (last->byte / COLMARK_INTERVAL + 1) * COLMARK_INTERVAL;
+    if (target > row->len) return 0;
+
+    int j = last->byte;
+    int col = editorRowAdvance(row, &j, last->col, target);
+    if (E.nmarks == E.marks_cap) {
+        E.marks_cap *= 2;
+        E.marks = realloc(E.marks, sizeof(struct colmark) * E.marks_cap);
+        if (!E.marks) die("realloc");
+    }
+    E.marks[E.nmarks].byte = j;
+    E.marks[E.nmarks].col = col;
+    E.nmarks++;
+    return 1;
+}
+
+void editorMarksFor(rownum at) {
+    if (E.marks_line != at) editorMarksReset(at);
+}
+
+// 行が at バイト目以降で書き換わったときに呼ぶ
+void editorMarksInvalidate(erow *row, int at) {
+    erow tmp;
+    if (E.marks_line < 0 || editorRowGet(E.marks_line, &tmp) != row) return;
+    while (E.nmarks > 1 && E.marks[E.nmarks - 1].byte > at) E.nmarks--;
+}
+
+// at行目のバイトインデックス(cx)を画面上のカラム位置(rx)に変換
+int editorCxToRx(rownum at, int cx) {
+    erow tmp;
+    erow *row = editorRowGet(at, &tmp);
+    if (row->plain) return cx < row->len ? cx : row->len;
+    editorMarksFor(at);
+    if (cx > row->len) cx = row->len;
+    while (E.marks[E.nmarks - 1].byte + COLMARK_INTERVAL <= cx && editorMarksExtend(row))
+        ;
+    int k = cx / COLMARK_INTERVAL;
+    if (k > E.nmarks - 1) k = E.nmarks - 1;
+    while (E.marks[k].byte > cx) k--;
+
+    int j = E.marks[k].byte;
+    return editorRowAdvance(row, &j, E.marks[k].col, cx);
+}
+
+// at行目で表示カラム rx を含む文字の先頭バイトを返す。*col にその文字の開始カラム
+int editorRxToCx(rownum at, int rx, int *col) {
+    erow tmp;
+    erow *row = editorRowGet(at, &tmp);
+    if (row->plain) {
+        *col = rx < row->len ? rx : row->len;
+        return *col;
+    }
+    editorMarksFor(at);
+    while (E.marks[E.nmarks - 1].col <= rx && editorMarksExtend(row))
+        ;
+    int lo = 0, hi = E.nmarks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (E.marks[mid].col <= rx) lo = mid;
+        else hi = mid - 1;
+    }
 
-        rx += width;
-        j += char_len;
+    int j = E.marks[lo].byte;
+    int c = E.marks[lo].col;
+    while (j < row->len) {
+        int w;
+        int clen = editorRowCharAt(row, j, &w);
+        if (c + w > rx) break;
+        c += w;
+        j += clen;
     }
-    return rx;
+    *col = c;
+    return j;
 }
 
-void editorDelRow(int at) {
+void editorDelRow(rownum at) {
     if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    if (!E.journal_mute) {
+        erow tmp;
+        erow *row = editorRowGet(at, &tmp);
+        editorJournalRow(JR_DELROW, at, row->eol, editorRowChars(row), row->len);
+    }
+    editorFreeRow(*editorRowSlot(at));
+    lsDelete(at);
     E.numrows--;
+    E.dirty++;
+    if (E.marks_line == at) E.marks_line = -1;
+    else if (E.marks_line > at) E.marks_line--;
+    editorFieldsReset();
+    editorFilterDelete(at);
+}
+
+void editorRowInsertChar(rownum y, int at, int c) {
+    char ch = c;
+    editorRowInsertString(y, at, &ch, 1);
+    E.cx++;
+}
+
+void editorRowAppendString(rownum y, const char *s, size_t len) {
+    editorRowInsertString(y, -1, s, len);
+}
+
+// y行目の改行コードを変える
+void editorRowSetEol(rownum y, int eol) {
+    erow *row = editorRowAt(y);
+    if (!row || row->eol == eol) return;
+    editorJournalEol(y, row->eol, eol);
+    row->eol = eol;
+    E.dirty++;
+}
+
+// --- エディタ操作 ---
+
+void editorInsertChar(int c) {
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(E.cy, E.cx, c);
+}
+
+void editorInsertNewline() {
+    if (E.cx == 0) {
+        erow tmp;
+        int eol = editorEolFor(editorRowGet(E.cy, &tmp));
+        editorInsertRow(E.cy, "", 0);
+        editorRowSetEol(E.cy, eol);
+    } else {
+        // ギャップをカーソル位置へ寄せると後半が連続になるので、それを新しい行へ
+        erow *row = editorRowAt(E.cy);
+        editorRowMaterialize(row);
+        editorRowMoveGap(row, E.cx);
+        const char *a, *tail;
+        int alen, taillen;
+        editorRowSpans(row, &a, &alen, &tail, &taillen);
+        int eol = row->eol;
+        editorInsertRow(E.cy + 1, (char *)tail, taillen);
+        editorRowSetEol(E.cy + 1, eol);   // 後半は元の行末を引き継ぐ
+        row = editorRowAt(E.cy);
+        editorRowSetEol(E.cy, editorEolFor(row));
+        editorRowDeleteRange(E.cy, E.cx, row->len - E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorBackspace() {
+    erow *row = editorRowAt(E.cy);
+    if (E.cx == 0 && E.cy == 0) return;
+    if (E.cx > 0) {
+        int delete_len = 0;
+        int pos = E.cx;
+        do {
+            pos--;
+            delete_len++;
+        } while (!row->plain && pos > 0 && is_utf8_continuation(editorRowByte(row, pos)));
+        editorRowDeleteRange(E.cy, pos, delete_len);
+        E.cx = pos;
+    } else {
+        erow *prev_row = editorRowAt(E.cy - 1);
+        E.cx = prev_row->len;
+        editorRowAppendString(E.cy - 1, editorRowChars(row), row->len);
+        editorRowSetEol(E.cy - 1, row->eol);   // つないだ行の行末が残る
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+// 複数行のテキスト (貼り付けなど) をカーソル位置へ一括挿入する
+// カーソルより後ろを一度だけ切り離し、行ごとに範囲挿入してから最後の行へ付け直す
+void editorInsertText(const char *s, size_t len) {
+    if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+
+    erow *row = editorRowAt(E.cy);
+    int taillen = row->len - E.cx;
+    char *tail = malloc(taillen + 1);
+    if (!tail) die("malloc");
+    for (int i = 0; i < taillen; i++) tail[i] = editorRowByte(row, E.cx + i);
+    editorRowDeleteRange(E.cy, E.cx, taillen);
+    // 間に挟まる行は元の行の改行コードに揃え、元の行末は最後の行へ移す
+    int eol = row->eol;
+    editorRowSetEol(E.cy, editorEolFor(row));
+
+    const char *p = s, *end = s + len;
+    int first = 1;
+    while (1) {
+        const char *q = p;
+        while (q < end && *q != '\r' && *q != '\n') q++;
+
+        if (first) {
+            editorRowInsertString(E.cy, E.cx, p, q - p);
+            E.cx += q - p;
+            first = 0;
+        } else {
+            E.cy++;
+            editorInsertRow(E.cy, (char *)p, q - p);
+            editorRowSetEol(E.cy, editorEolFor(editorRowAt(E.cy - 1)));
+            E.cx = q - p;
+        }
+        if (q == end) break;
+        // CRLF / CR / LF をそれぞれ1つの改行として扱う
+        if (*q == '\r' && q + 1 < end && q[1] == '\n') q++;
+        p = q + 1;
+        if (p == end) {
+            E.cy++;
+            editorInsertRow(E.cy, "", 0);
+            editorRowSetEol(E.cy, editorEolFor(editorRowAt(E.cy - 1)));
+            E.cx = 0;
+            break;
+        }
+    }
+
+    editorRowAppendString(E.cy, tail, taillen);
+    editorRowSetEol(E.cy, eol);
+    free(tail);
+}
+
+// 貼り付けられたテキストを挿入する (端末を乱す制御文字は落とす)
+void editorPaste() {
+    size_t n = 0;
+    for (size_t i = 0; i < E.pastelen; i++) {
+        unsigned char c = E.paste[i];
+        if (c >= 0x20 || c == '\t' || c == '\r' || c == '\n') E.paste[n++] = c;
+    }
+    editorInsertText(E.paste, n);
+}
+
+// カーソル直前の単語を削除 (Ctrl+W)
+void editorDeleteWord() {
+    erow *row = editorRowAt(E.cy);
+    if (E.cx == 0) return;
+
+    // スペースをスキップ
+    int pos = E.cx;
+    while (pos > 0 && isspace((unsigned char)editorRowByte(row, pos - 1))) {
+        pos--;
+    }
+    // 単語の先頭を探す
+    while (pos > 0 && !isspace((unsigned char)editorRowByte(row, pos - 1))) {
+        // UTF-8の後退処理（本当はもっと厳密にやるべきだが、簡易的にスペース区切りで動かす）
+        pos--;
+        while (pos > 0 && is_utf8_continuation(editorRowByte(row, pos))) pos--;
+    }
+
+    // posまでを一括削除
+    editorRowDeleteRange(E.cy, pos, E.cx - pos);
+    E.cx = pos;
+}
+
+// 行頭からカーソルまで削除 (Ctrl+U)
+void editorDeleteToStart() {
+    if (E.cy >= E.numrows || E.cx == 0) return;
+    editorRowDeleteRange(E.cy, 0, E.cx);
+    E.cx = 0;
+}
+
+// カーソルから行末まで削除 (Ctrl+K)
+void editorDeleteToEnd() {
+    erow *row = editorRowAt(E.cy);
+    if (!row) return;
+    editorRowDeleteRange(E.cy, E.cx, row->len - E.cx);
+}
+
+void editorGoToLine() {
+    char *input = editorPrompt("Go to line: %s", NULL);
+    if (input) {
+        rownum linenum = atoll(input) - E.rowbase;
+        free(input);
+        if (linenum > 0 && linenum <= E.numrows) {
+            E.cy = linenum - 1;
+            E.cx = 0;
+        }
+    }
+}
+
+// row のキー欄 (E.key_field 番目の欄、0なら行全体) の先頭 klen バイトを key と比べる。
+// 欄が短ければキーより小さいとみなす
+int editorKeyCompare(erow *row, const char *key, int klen) {
+    int j = 0;
+    for (int f = 1; f <= E.key_field; f++) {
+        if (E.key_delim) {
+            if (f > 1) {
+                while (j < row->len && editorRowByte(row, j) != E.key_delim) j++;
+                j++;
+            }
+        } else {
+            // 空白区切りでは先頭と欄の間の連続した空白を読み飛ばす
+            if (f > 1) while (j < row->len && !isblank((unsigned char)editorRowByte(row, j))) j++;
+            while (j < row->len && isblank((unsigned char)editorRowByte(row, j))) j++;
+        }
+    }
+    for (int i = 0; i < klen; i++, j++) {
+        int c = -1;
+        if (j < row->len) {
+            c = (unsigned char)editorRowByte(row, j);
+            if (E.key_field > 0 && (E.key_delim ? c == E.key_delim : isblank(c))) c = -1;
+        }
+        if (c != (unsigned char)key[i]) return c < (unsigned char)key[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// 整列済みのファイルで、キーが入力以上になる最初の行へ飛ぶ (Ctrl+B)。
+// 二分探索なので読むのは O(log n) 行だけ
+void editorJumpToKey() {
+    char *key = editorPrompt("Jump to key: %s", NULL);
+    if (!key) return;
+    int klen = strlen(key);
+    rownum lo = 0, hi = E.numrows;
+    while (lo < hi) {
+        rownum mid = lo + (hi - lo) / 2;
+        erow tmp;
+        if (editorKeyCompare(editorRowGet(mid, &tmp), key, klen) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    free(key);
+    if (E.numrows == 0) return;
+    // どの行よりも大きければ最終行へ
+    E.cy = lo < E.numrows ? lo : E.numrows - 1;
+    E.cx = 0;
+}
+
+// --- 入出力 (Pipe対応) ---
+
+// s[0..len) を fd の off バイト目から書き切る
+int editorPwriteAll(int fd, const char *s, size_t len, size_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, s, len, off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        s += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+// --- 並列実行 ---
+// 大きなファイルの索引作成のように、独立した仕事をコア数だけ同時に走らせる
+
+#define PAR_MAX_THREADS 64
+
+struct parjob {
+    void (*fn)(void *);
+    void *arg;
+};
+
+void *editorThreadMain(void *arg) {
+    struct parjob *job = arg;
+    job->fn(job->arg);
+    return NULL;
+}
+
+// jobs の n 個の要素 (size バイトずつ) それぞれについて fn を呼び、全部終わるまで待つ。
+// 先頭の仕事は呼び出し元のスレッドで行い、スレッドを作れなければその場で実行する
+void editorRunParallel(void (*fn)(void *), void *jobs, size_t size, int n) {
+    pthread_t th[PAR_MAX_THREADS];
+    struct parjob pj[PAR_MAX_THREADS];
+    int started[PAR_MAX_THREADS];
+    if (n > PAR_MAX_THREADS) n = PAR_MAX_THREADS;
+
+    for (int i = 1; i < n; i++) {
+        pj[i].fn = fn;
+        pj[i].arg = (char *)jobs + size * i;
+        started[i] = pthread_create(&th[i], NULL, editorThreadMain, &pj[i]) == 0;
+    }
+    if (n > 0) fn(jobs);
+    for (int i = 1; i < n; i++) {
+        if (started[i]) pthread_join(th[i], NULL);
+        else fn((char *)jobs + size * i);
+    }
+}
+
+// 裏で動くスレッドが仕事の区切りごとに1バイト書くパイプの書き込み側 (作れなければ-1)
+int editorNotifyPipe() {
+    if (E.notify_pipe[0] == -1) {
+        if (pipe(E.notify_pipe) == -1) {
+            E.notify_pipe[0] = E.notify_pipe[1] = -1;
+            return -1;
+        }
+        fcntl(E.notify_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(E.notify_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    return E.notify_pipe[1];
+}
+
+// 溜まった通知を読み捨てる
+void editorDrainNotify() {
+    if (E.notify_pipe[0] == -1) return;
+    char buf[64];
+    while (read(E.notify_pipe[0], buf, sizeof(buf)) > 0);
+}
+
+// --- 行索引 ---
+// 改行は64バイトずつビットマスクにして探す (AVX2/SSE2、なければ1バイトずつ)。
+// 大きな入力は行境界で区切り、区間ごとに別スレッドで葉ノードまで組み立ててから
+// 順に木へつなぐ
+
+#define INDEX_CHUNK_MIN (16 << 20)  // 1スレッドに任せる最小の大きさ
+
+// p から64バイト (end まで) を調べて '\n' の位置のビットを返す。
+// *special には表示可能なASCII以外のバイト (改行と、その直前のCRを除く)、
+// *nul にはNULの位置のビットを入れる
+uint64_t editorScanBlock(const char *p, const char *end, uint64_t *special, uint64_t *nul) {
+    uint64_t nl = 0, sp = 0, cr = 0, z = 0;
+    if (end - p >= 64) {
+        // CRとNULは「表示可能なASCII以外」に含まれるので、それがあるときだけ調べる
+#if defined(__AVX2__)
+        const __m256i vnl = _mm256_set1_epi8('\n');
+        const __m256i vsp = _mm256_set1_epi8(0x20), vdel = _mm256_set1_epi8(0x7f);
+        __m256i v[2];
+        for (int i = 0; i < 2; i++) {
+            v[i] = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+            // 符号付き比較なので 0x80以上 も 0x20未満 と一緒に引っかかる
+            __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(vsp, v[i]), _mm256_cmpeq_epi8(v[i], vdel));
+            nl |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[i], vnl)) << (32 * i);
+            sp |= (uint64_t)(uint32_t)_mm256_movemask_epi8(bad) << (32 * i);
+        }
+        if (sp & ~nl) {
+            const __m256i vcr = _mm256_set1_epi8('\r');
+            for (int i = 0; i < 2; i++) {
+                cr |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[i], vcr)) << (32 * i);
+                z |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v[i], _mm256_setzero_si256())) << (32 * i);
+            }
+        }
+#elif defined(__SSE2__)
+        const __m128i vnl = _mm_set1_epi8('\n');
+        const __m128i vsp = _mm_set1_epi8(0x20), vdel = _mm_set1_epi8(0x7f);
+        __m128i v[4];
+        for (int i = 0; i < 4; i++) {
+            v[i] = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+            __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v[i], vsp), _mm_cmpeq_epi8(v[i], vdel));
+            nl |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], vnl)) << (16 * i);
+            sp |= (uint64_t)(uint16_t)_mm_movemask_epi8(bad) << (16 * i);
+        }
+        if (sp & ~nl) {
+            const __m128i vcr = _mm_set1_epi8('\r');
+            for (int i = 0; i < 4; i++) {
+                cr |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], vcr)) << (16 * i);
+                z |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], _mm_setzero_si128())) << (16 * i);
+            }
+        }
+#else
+        for (int i = 0; i < 64; i++) {
+            unsigned char c = p[i];
+            if (c == '\n') nl |= (uint64_t)1 << i;
+            if (c == '\r') cr |= (uint64_t)1 << i;
+            if (c < 0x20 || c >= 0x7f) sp |= (uint64_t)1 << i;
+            if (c == 0) z |= (uint64_t)1 << i;
+        }
+#endif
+    } else {
+        for (int i = 0; i < end - p; i++) {
+            unsigned char c = p[i];
+            if (c == '\n') nl |= (uint64_t)1 << i;
+            if (c == '\r') cr |= (uint64_t)1 << i;
+            if (c < 0x20 || c >= 0x7f) sp |= (uint64_t)1 << i;
+            if (c == 0) z |= (uint64_t)1 << i;
+        }
+    }
+    // 行末のCRは改行コードの一部。ブロック末尾のCRは次のバイトを覗いて判断する
+    uint64_t crlf = cr & (nl >> 1);
+    if ((cr >> 63) && end - p > 64 && p[64] == '\n') crlf |= (uint64_t)1 << 63;
+    *special = sp & ~nl & ~crlf;
+    *nul = z;
+    return nl;
+}
+
+// s[0..len) に表示可能なASCII以外が含まれていなければ1
+int editorIsPlain(const char *s, size_t len) {
+    const char *end = s + len;
+    for (; s < end; s += 64) {
+        uint64_t special, nul;
+        editorScanBlock(s, end, &special, &nul);
+        // 末尾のCR+LFは行の中身としては渡されないので、ここでは区別しなくてよい
+        if (special) return 0;
+    }
+    return 1;
+}
+
+// s[0..len) が正しいUTF-8なら len、そうでなければ最初の不正なバイトの位置を返す。
+// 冗長な表現・サロゲート・U+10FFFF超えも不正とする
+size_t editorUtf8Check(const char *str, size_t len) {
+    const unsigned char *s = (const unsigned char *)str;
+    size_t i = 0;
+    while (i < len) {
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        int n;
+        unsigned char lo = 0x80, hi = 0xBF;   // 2バイト目に許される範囲
+        if (c >= 0xC2 && c <= 0xDF) n = 2;
+        else if (c >= 0xE0 && c <= 0xEF) {
+            n = 3;
+            if (c == 0xE0) lo = 0xA0;
+            if (c == 0xED) hi = 0x9F;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            n = 4;
+            if (c == 0xF0) lo = 0x90;
+            if (c == 0xF4) hi = 0x8F;
+        } else {
+            return i;
+        }
+        if (len - i < (size_t)n || s[i + 1] < lo || s[i + 1] > hi) return i;
+        for (int k = 2; k < n; k++) {
+            if (!is_utf8_continuation(s[i + k])) return i;
+        }
+        i += n;
+    }
+    return len;
+}
+
+int editorCtz64(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+// 索引作成の1区間分。先頭は行頭で、最後の区間以外は改行で終わる
+struct ixchunk {
+    const char *p;
+    size_t len;
+    size_t base;        // p の元データ内でのオフセット
+    int at_eof;         // 改行のない末尾も行にするか
+    lsnode **leaves;    // 組み立てた葉 (順番どおり)
+    int nleaves;
+    int leafcap;
+    size_t used;        // 行として確定したバイト数
+    size_t nul_off;     // 最初のNULの位置 (SIZE_MAXならなし)
+    rownum bad_rows;    // 不正なUTF-8を含む行の数
+    rownum bad_row;     // そのうち最初の行 (区間内での番号)
+    rownum nrows;
+};
+
+void editorChunkAddRow(struct ixchunk *c, const char *line, size_t len, int eol, int plain) {
+    lsnode *leaf = c->nleaves ? c->leaves[c->nleaves - 1] : NULL;
+    if (!leaf || leaf->n == LS_LEAF_MAX) {
+        if (c->nleaves == c->leafcap) {
+            c->leafcap = c->leafcap ? c->leafcap * 2 : 16;
+            c->leaves = realloc(c->leaves, sizeof(lsnode *) * c->leafcap);
+            if (!c->leaves) die("realloc");
+        }
+        leaf = c->leaves[c->nleaves++] = lsNewNode(1);
+    }
+    erow row;
+    if (eol == EOL_CRLF) len--;
+    row.size = 0;
+    row.len = len;
+    row.chars = NULL;
+    row.gap = 0;
+    row.eol = eol;
+    row.plain = plain;
+    row.off = c->base + (line - c->p);
+    leaf->u.rows[leaf->n++] = editorRowEncode(&row);
+    c->nrows++;
+}
+
+// 区間 c の行として line[0..len) を加える。ASCII以外を含む行はUTF-8として検査する
+void editorChunkAddLine(struct ixchunk *c, const char *line, size_t len, int eol, int plain) {
+    // 長すぎる行は ROW_MAX_LEN 以下ずつ改行なしの行に分ける。保存すれば元どおりつながる
+    size_t crlf = eol == EOL_CRLF;
+    while (len - crlf > ROW_MAX_LEN) {
+        size_t n = ROW_MAX_LEN;
+        while (n > ROW_MAX_LEN - 4 && is_utf8_continuation(line[n])) n--;  // 文字の途中では切らない
+        editorChunkAddLine(c, line, n, EOL_NONE, plain);
+        line += n;
+        len -= n;
+    }
+    if (!plain && editorUtf8Check(line, len - (eol == EOL_CRLF)) != len - (eol == EOL_CRLF)) {
+        if (c->bad_rows++ == 0) c->bad_row = c->nrows;
+    }
+    editorChunkAddRow(c, line, len, eol, plain);
+}
+
+void editorIndexChunk(void *arg) {
+    struct ixchunk *c = arg;
+    const char *p = c->p, *end = c->p + c->len;
+    const char *line = p;
+    int plain = 1;  // 今の行にまだ表示可能なASCII以外が出てきていない
+
+    c->nul_off = SIZE_MAX;
+    for (; p < end; p += 64) {
+        uint64_t special, nul;
+        uint64_t mask = editorScanBlock(p, end, &special, &nul);
+        if (nul && c->nul_off == SIZE_MAX) c->nul_off = c->base + (p - c->p) + editorCtz64(nul);
+        while (mask) {
+            int bit = editorCtz64(mask);
+            const char *nl = p + bit;
+            mask &= mask - 1;
+            // この改行より前のビットはこの行のもの
+            uint64_t mine = special & (((uint64_t)1 << bit) - 1);
+            if (mine) plain = 0;
+            special &= ~mine;
+            int eol = nl > line && nl[-1] == '\r' ? EOL_CRLF : EOL_LF;
+            editorChunkAddLine(c, line, nl - line, eol, plain);
+            line = nl + 1;
+            plain = 1;
+        }
+        if (special) plain = 0;
+    }
+    if (c->at_eof && line < end) {
+        editorChunkAddLine(c, line, end - line, EOL_NONE, plain);
+        line = end;
+    }
+    c->used = line - c->p;
+}
+
+// 区間で組み立てた葉を末尾へつなぐ
+void editorLinkChunk(struct ixchunk *c) {
+    if (c->nul_off < E.nul_off) E.nul_off = c->nul_off;
+    if (c->bad_rows && E.bad_rows == 0) E.bad_line = E.rowbase + E.numrows + c->bad_row;
+    E.bad_rows += c->bad_rows;
+    for (int j = 0; j < c->nleaves; j++) {
+        lsnode *leaf = c->leaves[j];
+        // 新しい行は先頭行の改行コードに合わせる
+        erow tmp;
+        erow *first = editorRowDecode(leaf->u.rows[0], &tmp);
+        if (E.numrows == 0 && E.rowbase == 0 && first->eol != EOL_NONE) E.eol = first->eol;
+        E.numrows += leaf->n;
+        lsAppendLeaf(leaf);
+    }
+    free(c->leaves);
+    c->leaves = NULL;
+    c->nleaves = 0;
+}
+
+// E.map の E.scanned 以降を走査して改行位置だけを索引化する
+// 行の中身はコピーせず、編集されるまで元データを参照し続ける
+// at_eof が0なら、改行がまだ届いていない末尾の行は次回に回す
+void editorIndexRows(int at_eof) {
+    const char *p = E.map + E.scanned;
+    const char *end = E.map + E.maplen;
+    size_t total = end - p;
+    if (total == 0) return;
+
+    int n = 1;
+    if (E.ncpu > 1 && total >= 2 * (size_t)INDEX_CHUNK_MIN) {
+        size_t want = total / INDEX_CHUNK_MIN;
+        n = want < (size_t)E.ncpu ? (int)want : E.ncpu;
+        if (n > PAR_MAX_THREADS) n = PAR_MAX_THREADS;
+    }
+
+    // ほぼ等分した位置から次の改行の直後までを各区間にする
+    struct ixchunk c[PAR_MAX_THREADS];
+    int k = 0;
+    while (k < n && p < end) {
+        const char *q = end;
+        if (k < n - 1) {
+            const char *target = E.map + E.scanned + total / n * (k + 1);
+            const char *nl = target > p ? memchr(target, '\n', end - target) : NULL;
+            if (nl) q = nl + 1;
+        }
+        memset(&c[k], 0, sizeof(c[k]));
+        c[k].p = p;
+        c[k].len = q - p;
+        c[k].base = E.mapbase + (p - E.map);
+        c[k].at_eof = at_eof && q == end;
+        p = q;
+        k++;
+    }
+    editorRunParallel(editorIndexChunk, c, sizeof(c[0]), k);
+
+    for (int i = 0; i < k; i++) editorLinkChunk(&c[i]);
+    E.scanned = (c[k - 1].p - E.map) + c[k - 1].used;
+}
+
+// --- 行索引キャッシュ ---
+// 大きなファイルは各行の長さを $XDG_CACHE_HOME/slit/ に保存しておき、次に開くときは
+// ファイル本体を読まずに行表を組み立てる。デバイス・inode・サイズ・更新時刻・変更時刻で
+// 照合する。追記されただけのログ (大きくなり、どちらの時刻も戻っていない) なら
+// 保存済みの部分はそのまま使い、増えた分だけを走査する
+
+#define INDEX_CACHE_MIN (16 << 20)  // これより小さいファイルは毎回走査しても速い
+#define INDEX_CACHE_MAGIC 0x3358444954494c53ULL  // "SLITIDX3"
+#define INDEX_CACHE_SAMPLES 16      // 内容の照合に使う標本の数 (先頭と末尾を含め等間隔)
+#define INDEX_CACHE_SAMPLE 512      // 標本1つのバイト数
+
+// キャッシュファイルの先頭。続いて nrows 個の uint32 が並び、
+// それぞれ (改行コードを含む行のバイト数) << 3 | ASCIIだけの行なら4 | 改行コード
+struct ixheader {
+    uint64_t magic;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t covered;   // 保存した行が占めるバイト数 (最後の改行の直後まで)
+    uint64_t nrows;
+    uint64_t samplehash;    // 元ファイルの [0, covered) から取った標本のハッシュ
+    uint64_t bad_rows;      // 不正なUTF-8を含む行の数と、その最初の行
+    uint64_t bad_line;
+};
+
+// FNV-1a
+uint64_t editorHashBytes(uint64_t h, const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// [0, covered) の先頭から末尾まで等間隔に取った標本のハッシュ。
+// 追記以外の書き換えを、ファイル全体を読まずにほぼ見分けられる
+uint64_t editorSampleHashOf(const char *map, size_t covered) {
+    uint64_t h = 14695981039346656037ULL;
+    if (covered <= INDEX_CACHE_SAMPLE * INDEX_CACHE_SAMPLES)
+        return editorHashBytes(h, map, covered);
+    size_t step = (covered - INDEX_CACHE_SAMPLE) / (INDEX_CACHE_SAMPLES - 1);
+    for (int i = 0; i < INDEX_CACHE_SAMPLES; i++)
+        h = editorHashBytes(h, map + step * i, INDEX_CACHE_SAMPLE);
+    return h;
+}
+
+uint64_t editorSampleHash(size_t covered) {
+    return editorSampleHashOf(E.map, covered);
+}
+
+// 時刻 (a, an) と (b, bn) を比べて -1, 0, 1 を返す
+int editorTimeCmp(int64_t a, int64_t an, int64_t b, int64_t bn) {
+    if (a != b) return a < b ? -1 : 1;
+    return an < bn ? -1 : an > bn;
+}
+
+// st のファイルに対応するキャッシュのパス (呼び出し側でfree)。
+// create なら置き場所のディレクトリも作る
+char *editorIndexCachePath(const struct stat *st, int create) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    const char *base = xdg && *xdg ? xdg : home && *home ? home : NULL;
+    if (!base) return NULL;
+
+    size_t len = strlen(base) + 64;
+    char *path = malloc(len);
+    if (!path) die("malloc");
+    snprintf(path, len, base == xdg ? "%s" : "%s/.cache", base);
+    if (create) mkdir(path, 0700);
+    strcat(path, "/slit");
+    if (create) mkdir(path, 0700);
+    size_t dirlen = strlen(path);
+    snprintf(path + dirlen, len - dirlen, "/%llx-%llx.idx",
+             (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    return path;
+}
+
+// キャッシュが元ファイルと照合できたら、保存済みの範囲の行表を組み立てて1を返す。
+// E.scanned はその範囲の終わりになるので、続きは通常どおり走査すればよい
+int editorLoadIndexCache(const struct stat *st, struct ixheader *hd) {
+    char *path = editorIndexCachePath(st, 0);
+    if (!path) return 0;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) return 0;
+
+    struct stat cst;
+    int ok = read(fd, hd, sizeof(*hd)) == (ssize_t)sizeof(*hd) && fstat(fd, &cst) == 0 &&
+             hd->magic == INDEX_CACHE_MAGIC &&
+             hd->dev == (uint64_t)st->st_dev && hd->ino == (uint64_t)st->st_ino &&
+             hd->nrows <= UINT64_MAX / 4 && hd->covered <= hd->size &&
+             (uint64_t)cst.st_size >= sizeof(*hd) + hd->nrows * 4;
+    if (ok) {
+        // 変更されていないか、保存済みの範囲はそのままで後ろに追記されただけか。
+        // 変更時刻は touch でも戻せないので、書き換えて更新時刻を戻したものも見分けられる
+        int mtime = editorTimeCmp(st->st_mtim.tv_sec, st->st_mtim.tv_nsec, hd->mtime_sec, hd->mtime_nsec);
+        int ctime = editorTimeCmp(st->st_ctim.tv_sec, st->st_ctim.tv_nsec, hd->ctime_sec, hd->ctime_nsec);
+        int same = hd->size == (uint64_t)st->st_size && mtime == 0 && ctime == 0;
+        int appended = (uint64_t)st->st_size > hd->size && mtime >= 0 && ctime >= 0;
+        ok = (same || appended) && editorSampleHash(hd->covered) == hd->samplehash;
+    }
+
+    // 元ファイルには触れずに葉を組み立てる
+    struct ixchunk c;
+    memset(&c, 0, sizeof(c));
+    c.p = E.map;
+    c.nul_off = SIZE_MAX;
+    size_t off = 0;
+    uint64_t left = ok ? hd->nrows : 0;
+    uint32_t buf[16384];
+    while (left > 0 && ok) {
+        size_t want = left < 16384 ? left : 16384;
+        if (read(fd, buf, want * 4) != (ssize_t)(want * 4)) {
+            ok = 0;
+            break;
+        }
+        for (size_t i = 0; i < want; i++) {
+            int eol = buf[i] & 3;
+            int plain = (buf[i] >> 2) & 1;
+            size_t span = buf[i] >> 3;
+            if (eol == EOL_NONE || eol > EOL_CRLF || span < (size_t)eol || span - eol > ROW_MAX_LEN ||
+                off + span > hd->covered) {
+                ok = 0;
+                break;
+            }
+            // 標本から外れた所で改行が動いていたら行表は使えない (走査し直す)。
+            // 行末のバイトだけを見るので、行の中身は読まない
+            const char *t = E.map + off + span;
+            if (t[-1] != '\n' || (eol == EOL_CRLF) != (span >= 2 && t[-2] == '\r')) {
+                ok = 0;
+                break;
+            }
+            editorChunkAddRow(&c, E.map + off, span - 1, eol, plain);
+            off += span;
+        }
+        left -= want;
+    }
+    close(fd);
+
+    if (!ok || off != hd->covered) {
+        for (int j = 0; j < c.nleaves; j++) {
+            for (int i = 0; i < c.leaves[j]->n; i++) editorFreeRow(c.leaves[j]->u.rows[i]);
+            free(c.leaves[j]);
+        }
+        free(c.leaves);
+        return 0;
+    }
+    editorLinkChunk(&c);
+    E.scanned = off;
+    E.bad_rows = hd->bad_rows;
+    E.bad_line = hd->bad_line;
+    return 1;
+}
+
+// 行表をキャッシュへ書く。old は読み込めたキャッシュの先頭 (なければNULL) で、
+// その場合は増えた行だけを書き足してから先頭を書き換える
+void editorSaveIndexCache(const struct stat *st, const struct ixheader *old) {
+    // 改行のない末尾の行は次に開くときに走査し直す
+    rownum nrows = E.numrows;
+    erow rt;
+    if (nrows > 0 && editorRowGet(nrows - 1, &rt)->eol == EOL_NONE) nrows--;
+
+    struct ixheader hd;
+    memset(&hd, 0, sizeof(hd));
+    hd.magic = INDEX_CACHE_MAGIC;
+    hd.dev = st->st_dev;
+    hd.ino = st->st_ino;
+    hd.size = st->st_size;
+    hd.mtime_sec = st->st_mtim.tv_sec;
+    hd.mtime_nsec = st->st_mtim.tv_nsec;
+    hd.ctime_sec = st->st_ctim.tv_sec;
+    hd.ctime_nsec = st->st_ctim.tv_nsec;
+    hd.nrows = nrows;
+    if (nrows > 0) {
+        erow *last = editorRowGet(nrows - 1, &rt);
+        hd.covered = last->off + last->len + last->eol;
+    }
+    hd.samplehash = editorSampleHash(hd.covered);
+    hd.bad_rows = E.bad_rows;
+    if (nrows < E.numrows) {
+        // 保存しない末尾の行の分は数えない
+        erow *tail = editorRowGet(nrows, &rt);
+        if (!tail->plain && editorUtf8Check(editorSrc(tail->off), tail->len) != (size_t)tail->len)
+            hd.bad_rows--;
+    }
+    hd.bad_line = hd.bad_rows ? E.bad_line : 0;
+    if (old && memcmp(old, &hd, sizeof(hd)) == 0) return;
+
+    char *path = editorIndexCachePath(st, 1);
+    if (!path) return;
+    char *tmp = NULL;
+    rownum from = old ? (rownum)old->nrows : 0;
+    int fd = old ? open(path, O_WRONLY) : -1;
+    if (fd == -1) {
+        // 新しく作るときは一時ファイルに書いてから置き換える
+        size_t tmplen = strlen(path) + 8;
+        tmp = malloc(tmplen);
+        snprintf(tmp, tmplen, "%s.XXXXXX", path);
+        fd = mkstemp(tmp);
+        from = 0;
+    }
+
+    int ok = fd != -1;
+    uint32_t buf[16384];
+    int nbuf = 0;
+    off_t pos = sizeof(hd) + (off_t)from * 4;
+    for (rownum i = from; i < nrows && ok; i++) {
+        erow *row = editorRowGet(i, &rt);
+        size_t span = (size_t)row->len + row->eol;
+        // 512MB以上の行と、分けた長い行の途中は表せないので諦める
+        if (span >= (1U << 29) || row->eol == EOL_NONE) ok = 0;
+        buf[nbuf++] = (uint32_t)span << 3 | row->plain << 2 | row->eol;
+        if (nbuf == 16384 || i == nrows - 1) {
+            if (editorPwriteAll(fd, (char *)buf, nbuf * 4, pos) == -1) ok = 0;
+            pos += nbuf * 4;
+            nbuf = 0;
+        }
+    }
+    // 行を書き終えてから先頭を書くので、途中で止まっても古い内容のまま読める
+    if (ok && editorPwriteAll(fd, (char *)&hd, sizeof(hd), 0) == -1) ok = 0;
+    if (fd != -1) close(fd);
+    if (tmp) {
+        if (!ok || rename(tmp, path) == -1) unlink(tmp);
+        free(tmp);
+    }
+    free(path);
+}
+
+// 保存で元ファイルが置き換わったら、もう使われないキャッシュを消す
+void editorDropIndexCache() {
+    struct stat st;
+    if (E.src_fd == -1 || fstat(E.src_fd, &st) == -1) return;
+    char *path = editorIndexCachePath(&st, 0);
+    if (path) unlink(path);
+    free(path);
+}
+
+// 通常ファイルをmmapして索引化する。mmapできない場合は0を返す
+// --follow では追記が見えるよう共有で大きめに予約する (空のファイルも開く)
+int editorMapFile(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (st.st_size == 0 && !E.follow)) return 0;
+    if ((unsigned long long)st.st_size > SIZE_MAX) return 0;
+    size_t maplen = E.follow ? MAP_RESERVE : (size_t)st.st_size;
+    if ((size_t)st.st_size > maplen) return 0;
+
+    char *map = mmap(NULL, maplen, PROT_READ, E.follow ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+
+    // バイナリチェック (先頭で分かるものは索引を作る前に断る)
+    size_t check_len = st.st_size < 1024 ? (size_t)st.st_size : 1024;
+    if (memchr(map, '\0', check_len)) {
+        munmap(map, maplen);
+        close(fd);
+        fprintf(stderr, "slit: Binary file detected. Cannot edit.\n");
+        exit(1);
+    }
+
+    E.map = map;
+    E.maplen = st.st_size;
+    E.mapcap = maplen;
+    struct ixheader hd;
+    int cached = E.index_cache && (size_t)st.st_size >= INDEX_CACHE_MIN &&
+                 editorLoadIndexCache(&st, &hd);
+    posix_madvise(E.map + E.scanned, E.maplen - E.scanned, POSIX_MADV_SEQUENTIAL);
+    editorIndexRows(1);
+    // 読んでいる間に切り詰められた後ろは0で埋まっている (handleBus)
+    if (E.map_lost) {
+        fprintf(stderr, "slit: File was truncated while loading. Cannot edit.\n");
+        exit(1);
+    }
+    // 索引作成の走査でファイル全体のNULも調べてある
+    if (E.nul_off != SIZE_MAX) {
+        fprintf(stderr, "slit: Binary file detected (NUL at byte %zu). Cannot edit.\n", E.nul_off);
+        exit(1);
+    }
+    if (E.index_cache && (size_t)st.st_size >= INDEX_CACHE_MIN)
+        editorSaveIndexCache(&st, cached ? &hd : NULL);
+    // 索引作成後はカーソル位置周辺しか触らない
+    posix_madvise(E.map, E.maplen, POSIX_MADV_RANDOM);
+    return 1;
+}
+
+// --- 一時ファイルへの退避 (スピル) ---
+// パイプ入力はmmapできないので、受信バッファが E.budget を超えたら索引済みの部分を
+// unlink済みの一時ファイルへ書き出してバッファから捨てる。退避した行は一時ファイルの
+// mmapを通して参照し、必要になったページだけがカーネルによって読み戻される
+
+// $TMPDIR などに name で始まる一時ファイルを作り、unlinkして返す (-1なら失敗)
+int editorTempFile(const char *name) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = access("/var/tmp", W_OK) == 0 ? "/var/tmp" : "/tmp";
+    size_t len = strlen(dir) + strlen(name) + 16;
+    char *path = malloc(len);
+    if (!path) die("malloc");
+    snprintf(path, len, "%s/%s.XXXXXX", dir, name);
+    int fd = mkstemp(path);
+    if (fd != -1) unlink(path);
+    free(path);
+    return fd;
+}
+
+int editorOpenSpill() {
+    int fd = editorTempFile("slit-spill");
+    if (fd == -1) return 0;
+
+    char *map = mmap(NULL, MAP_RESERVE, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    E.spill_fd = fd;
+    E.spill_map = map;
+    return 1;
+}
+
+void editorSpill() {
+    if (E.budget == 0 || E.maplen <= E.budget || E.scanned == 0) return;
+    if (E.spill_fd == -1 && !editorOpenSpill()) {
+        E.budget = 0;   // 一時ファイルが使えなければメモリに溜め続ける
+        return;
+    }
+    if (E.mapbase + E.scanned > MAP_RESERVE) {
+        E.budget = 0;
+        return;
+    }
+
+    // 索引済みの部分 (行の途中で切れない) を元データと同じオフセットに書く
+    size_t done = 0;
+    while (done < E.scanned) {
+        ssize_t n = pwrite(E.spill_fd, E.map + done, E.scanned - done, E.mapbase + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            E.budget = 0;   // ディスクが一杯などの場合も同様
+            return;
+        }
+        done += n;
+    }
+    memmove(E.map, E.map + E.scanned, E.maplen - E.scanned);
+    E.maplen -= E.scanned;
+    E.mapbase += E.scanned;
+    E.scanned = 0;
+    E.spill_end = E.mapbase;
+
+    // これまでに参照したページを貼り直して手放し、RSSを予算内に保つ
+    mmap(E.spill_map, E.spill_end, PROT_READ, MAP_SHARED | MAP_FIXED, E.spill_fd, 0);
+}
+
+// --- ストリーミング入力 (パイプモード) ---
+// 標準入力はEOFを待たずに、届いた分から行として追加していく。
+// 受信データは E.map に溜め、行はそのオフセットを参照する
+
+// 指定行への移動が受信待ちなら、届いた時点で移動する
+void editorApplyGotoLine() {
+    if (E.goto_line < 0) return;
+    if (E.goto_line < E.rowbase) {
+        E.goto_line = -1;
+    } else if (E.goto_line < E.rowbase + E.numrows) {
+        E.cy = E.goto_line - E.rowbase;
+        E.goto_line = -1;
+    } else if (E.stream_fd == -1) {
+        E.cy = E.numrows - 1;
+        E.goto_line = -1;
+    }
+}
+
+// 標準入力から届いている分を読み込む。行数が変わったら1を返す
+int editorIngest() {
+    if (E.stream_fd == -1) return 0;
+    if (E.mapcap - E.maplen < 65536) {
+        size_t cap = E.mapcap ? E.mapcap * 2 : 1 << 20;
+        char *map = realloc(E.map, cap);
+        if (!map) die("realloc");
+        E.map = map;
+        E.mapcap = cap;
+    }
+
+    ssize_t n = read(E.stream_fd, E.map + E.maplen, E.mapcap - E.maplen);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+
+    rownum old = E.numrows;
+    if (n > 0) {
+        E.maplen += n;
+        editorIndexRows(0);
+        editorSpill();
+    } else {
+        // EOF (またはエラー): 改行のない最終行も行として確定させる
+        editorIndexRows(1);
+        E.stream_fd = -1;
+        if (E.numrows == 0 && E.rowbase == 0) {
+            E.journal_mute++;
+            editorInsertRow(0, "", 0);
+            editorRowAt(0)->eol = EOL_NONE;   // 空の入力は空のまま返す
+            E.journal_mute--;
+        }
+    }
+    editorApplyGotoLine();
+    editorFilterExtend();
+    return E.numrows != old || E.stream_fd == -1;
+}
+
+// 保存後、まだ届いていない入力は加工せずにそのまま標準出力へ流す
+void editorPassthrough() {
+    if (E.stream_fd == -1) return;
+    fflush(stdout);
+    // 改行が未着の末尾部分
+    if (E.maplen > E.scanned &&
+        write(STDOUT_FILENO, E.map + E.scanned, E.maplen - E.scanned) == -1) return;
+
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(E.stream_fd, buf, sizeof(buf))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (write(STDOUT_FILENO, buf, n) == -1) return;
+    }
+}
+
+// 先頭から n 行を標準出力へ送り出して手放す (パイプモードのみ)
+// 下流のコマンドは編集の終了を待たずに処理を始められ、メモリも送出分だけ空く
+void editorCommitRows(rownum n) {
+    if (E.filename || n <= 0) return;
+    // 絞り込みのスレッドが行を読み終えてから消す (できあがるとカーソルが動くことがある)
+    editorFilterFinish();
+    if (n > E.cy) n = E.cy;
+    // 送り出した行は元に戻せない
+    editorColumnKeepHeader();
+    E.journal_mute++;
+    for (rownum i = 0; i < n; i++) {
+        const char *a, *b;
+        int alen, blen;
+        erow tmp;
+        erow *row = editorRowGet(0, &tmp);
+        editorRowSpans(row, &a, &alen, &b, &blen);
+        fwrite(a, 1, alen, stdout);
+        if (blen) fwrite(b, 1, blen, stdout);
+        fputs(editorEolChars(row->eol), stdout);
+        editorDelRow(0);
+    }
+    fflush(stdout);
+    E.journal_mute--;
+    editorJournalReset();
+    E.cy -= n;
+    E.rowbase += n;
+
+    // 残りの行が参照していない受信データの先頭部分を詰める
+    // (半分以上が不要になったときだけ動かすので償却O(1))
+    size_t keep = E.mapbase + E.scanned;
+    for (rownum i = 0; i < E.numrows; i++) {
+        erow tmp;
+        erow *row = editorRowGet(i, &tmp);
+        if (!row->chars) {
+            keep = row->off;
+            break;
+        }
+    }
+    size_t drop = keep > E.mapbase ? keep - E.mapbase : 0;
+    if (drop > 0 && drop >= E.maplen / 2) {
+        memmove(E.map, E.map + drop, E.maplen - drop);
+        E.maplen -= drop;
+        E.scanned -= drop;
+        E.mapbase += drop;
+    }
+}
+
+// カーソルが E.window 行より下へ進んだら、それより上の行を自動で送り出す
+void editorAutoCommit() {
+    if (E.window > 0 && E.cy > E.window) editorCommitRows(E.cy - E.window);
+}
+
+// --- ファイルの追従 (--follow) ---
+// 書き込み中のログなどを開いたまま、追記された分だけを索引化して行に加える。
+// 変化は inotify で知り、通知の届かないファイルシステムでも取りこぼさないよう
+// 一定間隔でも大きさと inode を調べる。切り詰めや差し替え (ローテーション) には:
+//   未保存の編集がなければ、新しい内容で開き直す
+//   差し替えで編集があれば、追従をやめて元のファイルの移った先へ保存するよう切り替える
+//   (開いたままなので読める。消されていたら <ファイル名>.slit-saved へ保存する)
+//   切り詰めで編集があれば、編集した行を <ファイル名>.slit-edits へ書き出してから
+//   開き直す (未編集行の元データはもうないので、バッファはそのままにできない)
+
+#define FOLLOW_POLL_MS 1000
+
+// E.filename の監視を張り直す
+void editorFollowWatch() {
+#ifdef __linux__
+    if (E.follow_fd == -1) E.follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (E.follow_fd == -1) return;
+    if (E.follow_wd != -1) inotify_rm_watch(E.follow_fd, E.follow_wd);
+    E.follow_wd = inotify_add_watch(E.follow_fd, E.filename,
+                                    IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#endif
+}
+
+void editorFollowStop(const char *why) {
+    E.follow = 0;
+    if (E.follow_fd != -1) close(E.follow_fd);
+    E.follow_fd = E.follow_wd = -1;
+    snprintf(E.notice, sizeof(E.notice), "%s", why);
+}
+
+// 追記された [E.maplen, size) を行にする
+void editorFollowGrow(size_t size) {
+    // 末尾の行を読み直すのは編集ではない
+    unsigned long long dirty = E.dirty;
+    E.journal_mute++;
+    rownum last = E.numrows - 1;
+    erow tmp;
+    erow *row = editorRowGet(last, &tmp);
+    if (row && row->eol == EOL_NONE) {
+        if (editorRowClean(row)) {
+            // 改行が未着だった最終行は、追記分とあわせて読み直す
+            E.scanned = row->off;
+            editorDelRow(last);
+        } else if (!dirty && E.maplen == 0) {
+            // 空のファイルの代わりに置いた空行
+            editorDelRow(last);
+        } else {
+            // 編集した最終行には、最初の改行までをつなげる
+            const char *p = E.map + E.maplen;
+            const char *nl = memchr(p, '\n', size - E.maplen);
+            size_t len = nl ? (size_t)(nl - p) : size - E.maplen;
+            int eol = nl ? EOL_LF : EOL_NONE;
+            if (nl && len > 0 && p[len - 1] == '\r') {
+                len--;
+                eol = EOL_CRLF;
+            }
+            editorRowAppendString(last, p, len);
+            editorRowSetEol(last, eol);
+            E.scanned = E.maplen + len + eol;
+        }
+    }
+    E.maplen = size;
+    editorIndexRows(1);
+    E.dirty = dirty;
+    E.journal_mute--;
+    editorFilterExtend();
+}
+
+// 編集した行と足した行を「行番号<TAB>内容」で <ファイル名>.slit-edits に書き足す
+int editorFollowRescue() {
+    size_t len = strlen(E.filename) + 16;
+    char *path = malloc(len);
+    if (!path) die("malloc");
+    snprintf(path, len, "%s.slit-edits", E.filename);
+    FILE *fp = fopen(path, "a");
+    free(path);
+    if (!fp) return -1;
+    int ok = 1;
+    for (rownum i = 0; i < E.numrows && ok; i++) {
+        erow tmp;
+        erow *row = editorRowGet(i, &tmp);
+        if (!row->chars) continue;
+        const char *a, *b;
+        int alen, blen;
+        editorRowSpans(row, &a, &alen, &b, &blen);
+        if (fprintf(fp, "%lld\t", E.rowbase + i + 1) < 0 ||
+            fwrite(a, 1, alen, fp) != (size_t)alen ||
+            (blen && fwrite(b, 1, blen, fp) != (size_t)blen) || fputc('\n', fp) == EOF) ok = 0;
+    }
+    if (fclose(fp) == EOF) ok = 0;
+    return ok ? 0 : -1;
+}
+
+// 差し替えられた元のファイル (cur) が今ある場所 (呼び出し側でfree)。消されていればNULL
+char *editorFollowMovedPath(const struct stat *cur) {
+#ifdef __linux__
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", E.src_fd);
+    char *path = realpath(link, NULL);
+    struct stat st;
+    if (path && stat(path, &st) == 0 && st.st_dev == cur->st_dev && st.st_ino == cur->st_ino)
+        return path;
+    free(path);
+#else
+    (void)cur;
+#endif
+    return NULL;
+}
+
+// fd のファイルで開き直す。カーソルはなるべく同じ行に置く。
+// 追従中に開き直せず追従をやめたら0
+int editorFollowReload(int fd) {
+    int ok = 1;
+    // 裏で行を読んでいるスレッドを止めてから木を捨てる。検索は開き直した後でやり直す
+    // (保存の終わりから呼ばれると、検索のプロンプトの途中のこともある)
+    editorFilterFinish();
+    int nlen, dir;
+    rownum origin;
+    char *needle = editorSearchSuspend(&nlen, &dir, &origin);
+    lsFree(E.root);
+    E.root = lsNewNode(1);
+    E.numrows = 0;
+    E.hint = NULL;
+    E.marks_line = -1;
+    editorFieldsReset();
+    munmap(E.map, E.mapcap);
+    E.map = NULL;
+    E.maplen = E.mapcap = E.scanned = 0;
+    E.nul_off = SIZE_MAX;
+    E.bad_rows = 0;
+    E.map_lost = 0;
+    if (fd != E.src_fd) close(E.src_fd);
+    E.src_fd = -1;
+    if (editorMapFile(fd)) {
+        E.src_fd = fd;
+        if (E.follow) editorFollowWatch();
+    } else {
+        // 追従しないファイルは空になっていれば開けない (空のバッファのまま)
+        close(fd);
+        if (E.follow) {
+            editorFollowStop("cannot reopen; follow stopped");
+            ok = 0;
+        }
+    }
+    E.journal_mute++;
+    if (E.numrows == 0) {
+        editorInsertRow(0, "", 0);
+        editorRowAt(0)->eol = EOL_NONE;
+    }
+    E.journal_mute--;
+    if (E.cy >= E.numrows) E.cy = E.numrows - 1;
+    E.cx = 0;
+    E.coloff = 0;
+    E.dirty = 0;
+    editorJournalReset();
+    editorFilterRefresh();
+    editorSearchResume(needle, nlen, dir, origin);
+    return ok;
+}
+
+// 元ファイルが切り詰められた。未編集行の元データはもうないので、編集した行を
+// <ファイル名>.slit-edits へ書き出してから fd で開き直す
+void editorReloadTruncated(int fd) {
+    const char *msg = "truncated; reloaded";
+    if (E.dirty) {
+        msg = editorFollowRescue() == 0 ? "truncated; edits in .slit-edits"
+                                        : "truncated; edits lost";
+    }
+    if (editorFollowReload(fd)) snprintf(E.notice, sizeof(E.notice), "%s", msg);
+}
+
+// 追従していないファイルも外で切り詰められることがある。その後ろを読んで SIGBUS に
+// なったか (handleBus)、大きさが縮んでいたら開き直す (追従中の縮みは editorFollow が見る)。
+// 開き直すのはプロンプトを閉じて、裏での保存が終わってから。表示を更新すべきなら1
+int editorSourceCheck() {
+    if (E.src_fd == -1 || E.in_prompt || E.save_pid > 0) return 0;
+    struct stat st;
+    if (!E.map_lost && (E.follow || fstat(E.src_fd, &st) == -1 || (size_t)st.st_size >= E.maplen))
+        return 0;
+    editorReloadTruncated(E.src_fd);
+    return 1;
+}
+
+// ファイルの変化を取り込む。表示を更新すべきなら1を返す
+int editorFollow() {
+    // 裏で保存している間は、保存が置き換えたファイルを見誤らないよう待つ
+    if (!E.follow || E.save_pid > 0) return 0;
+#ifdef __linux__
+    // 通知の中身は見ずに読み捨て、大きさと inode で判断する
+    char buf[4096];
+    while (E.follow_fd != -1 && read(E.follow_fd, buf, sizeof(buf)) > 0) {}
+#endif
+    struct stat cur, st;
+    if (fstat(E.src_fd, &cur) == -1) return 0;
+    if ((size_t)cur.st_size > E.maplen) {
+        size_t size = cur.st_size;
+        if (size > E.mapcap || memchr(E.map + E.maplen, '\0', size - E.maplen)) {
+            editorFollowStop("binary data; follow stopped");
+            return 1;
+        }
+        editorFollowGrow(size);
+        return 1;
+    }
+    // 開き直すのはプロンプトを閉じてから
+    if (E.in_prompt) return 0;
+    int replaced = stat(E.filename, &st) == -1 || st.st_dev != cur.st_dev || st.st_ino != cur.st_ino;
+    if ((size_t)cur.st_size < E.maplen) {
+        int fd = replaced ? open(E.filename, O_RDONLY) : -1;
+        editorReloadTruncated(fd != -1 ? fd : E.src_fd);
+        return 1;
+    }
+    if (!replaced) return 0;
+    if (E.dirty) {
+        char *path = editorFollowMovedPath(&cur);
+        if (!path) {
+            size_t len = strlen(E.filename) + 16;
+            path = malloc(len);
+            if (!path) die("malloc");
+            snprintf(path, len, "%s.slit-saved", E.filename);
+        }
+        free(E.filename);
+        E.filename = path;
+        const char *base = strrchr(path, '/');
+        char msg[sizeof(E.notice)];
+        snprintf(msg, sizeof(msg), "replaced; saving to %s", base ? base + 1 : path);
+        editorFollowStop(msg);
+        return 1;
+    }
+    // 新しいファイルができていなければ次の見回りで確かめる
+    int fd = open(E.filename, O_RDONLY);
+    if (fd == -1) return 0;
+    editorFollowReload(fd);
+    if (E.follow) snprintf(E.notice, sizeof(E.notice), "replaced; reloaded");
+    return 1;
+}
+
+// --- 編集の記録 (ジャーナル) ---
+// 行の挿入・削除と行内の範囲の置き換えを、消した内容も含めて追記専用のファイルに記録する。
+// ファイルモードでは元ファイルの横の .<名前>.slit-journal に置き、落ちたり端末が切れたり
+// しても、次に開いたときに記録をたどり直して編集を取り戻せる。書き込みはキー入力を
+// 待つ前にまとめて行い、fdatasync は JOURNAL_SYNC_MS に1回までにまとめる。
+// 元に戻す (Ctrl+Z) とやり直し (Ctrl+Y) も記録を読み返して行うので、
+// メモリにはコマンドごとの記録の位置しか持たない
+
+#define JOURNAL_MAGIC 0x314c4e4a54494c53ULL  // "SLITJNL1"
+#define JOURNAL_FLUSH (1 << 20)     // 溜まった記録がこれを超えたら待たずに書く
+#define JOURNAL_SYNC_MS 100         // fdatasync の間隔。続けて打った分はまとめて1回で届ける
+#define JOURNAL_JOB_MAX (1 << 30)   // 置換のワーカー1つが溜めておける記録の大きさ
+
+// ジャーナルファイルの先頭。続いて記録が並ぶ
+struct jheader {
+    uint64_t magic;
+    uint64_t base;          // 記録を始めたときの元ファイルの大きさ
+    uint64_t samplehash;    // 元ファイルの [0, base) の標本のハッシュ
+};
+
+// 記録1つの頭。続いて old と new の中身が並ぶ
+struct jrecord {
+    uint32_t check;     // 頭の残りと中身のハッシュ (書きかけの記録を見分ける)
+    uint8_t type;
+    uint8_t eol;        // JR_INSROW・JR_DELROW は行の改行コード、JR_EOL は変える前
+    uint8_t eol2;       // JR_EOL で変えた後の改行コード
+    uint8_t pad;
+    int64_t row;
+    int32_t col;
+    uint32_t oldlen, newlen;
+};
+
+// filename の横に置くジャーナルのパス (呼び出し側でfree)。通常ファイル以外ならNULL
+char *editorJournalPath(const char *filename) {
+    struct stat st;
+    if (stat(filename, &st) == 0 && !S_ISREG(st.st_mode)) return NULL;
+    const char *slash = strrchr(filename, '/');
+    int dirlen = slash ? (int)(slash - filename + 1) : 0;
+    size_t len = strlen(filename) + 32;
+    char *path = malloc(len);
+    if (!path) die("malloc");
+    snprintf(path, len, "%.*s.%s.slit-journal", dirlen, filename, filename + dirlen);
+    return path;
+}
+
+// 他の slit が使っているジャーナルなら-1
+int editorJournalLock(int fd) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    return fcntl(fd, F_SETLK, &fl);
+}
+
+// fd を空にして、今の元ファイルに対する記録として書き始める
+int editorJournalHeader(int fd) {
+    struct jheader hd;
+    memset(&hd, 0, sizeof(hd));
+    hd.magic = JOURNAL_MAGIC;
+    hd.base = E.filename && E.map ? E.maplen : 0;
+    hd.samplehash = editorSampleHash(hd.base);
+    if (ftruncate(fd, 0) == -1 || editorPwriteAll(fd, (char *)&hd, sizeof(hd), 0) == -1) return -1;
+    E.journal_end = sizeof(hd);
+    return 0;
+}
+
+// 記録を書くファイルを用意する。使えなければ-1を返し、以後は記録しない
+int editorJournalOpen() {
+    if (E.journal_fd != -1) return 0;
+    if (E.journal_mute) return -1;
+    int fd = -1;
+    if (E.journal_path) {
+        fd = open(E.journal_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd != -1 && editorJournalLock(fd) == -1) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd == -1) {
+            free(E.journal_path);
+            E.journal_path = NULL;
+        }
+    }
+    // 横に置けなければ (パイプモードも) 元に戻すためだけに一時ファイルを使う
+    if (fd == -1) fd = editorTempFile("slit-journal");
+    if (fd != -1 && editorJournalHeader(fd) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        E.journal_mute++;
+        return -1;
+    }
+    E.journal_fd = fd;
+    return 0;
+}
+
+// 記録を続けられなくなったら、以後は記録せず、記録を頼る元に戻す履歴も捨てる
+void editorJournalGiveUp() {
+    if (E.journal_fd != -1) close(E.journal_fd);
+    E.journal_fd = -1;
+    E.journal_mute++;
+    E.undo_n = E.undo_done = 0;
+    E.journal_buf.len = 0;
+}
+
+// 溜まった記録をファイルへ書く。書けなくなったら記録をやめる (元に戻す履歴も消える)
+void editorJournalWrite() {
+    if (E.journal_fd == -1 || E.journal_buf.len == 0) return;
+    if (editorPwriteAll(E.journal_fd, E.journal_buf.b, E.journal_buf.len, E.journal_end) == -1) {
+        editorJournalGiveUp();
+    } else {
+        E.journal_end += E.journal_buf.len;
+        E.journal_unsynced += E.journal_buf.len;
+    }
+    E.journal_buf.len = 0;
+}
+
+long long editorNowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ここまでの記録をすぐにディスクへ届ける (終わる前など)
+void editorJournalSync() {
+    editorJournalWrite();
+    if (!E.journal_unsynced) return;
+    if (E.journal_path) fdatasync(E.journal_fd);
+    E.journal_unsynced = 0;
+    E.journal_synced = editorNowMs();
+}
+
+// キー入力を待つ前に呼ぶ。記録はすぐ書くが、fdatasync は前回から JOURNAL_SYNC_MS 経つか
+// JOURNAL_FLUSH 溜まるまで待ってまとめる。届けていない記録が残れば、届けるまでの
+// 残りのミリ秒を返す (呼び出し側はそれ以上待たずにもう一度呼ぶ)。なければ-1
+int editorJournalGroupSync() {
+    editorJournalWrite();
+    if (!E.journal_unsynced) return -1;
+    long long wait = E.journal_synced + JOURNAL_SYNC_MS - editorNowMs();
+    if (wait > 0 && E.journal_unsynced < JOURNAL_FLUSH) return (int)wait;
+    editorJournalSync();
+    return -1;
+}
+
+// 記録を捨てて、今の内容から記録し直す (元に戻す履歴も消える)
+void editorJournalReset() {
+    E.journal_buf.len = 0;
+    E.undo_n = E.undo_done = 0;
+    E.step_open = 0;
+    if (E.journal_fd != -1 && editorJournalHeader(E.journal_fd) == -1) {
+        close(E.journal_fd);
+        E.journal_fd = -1;
+        E.journal_mute++;
+    }
+}
+
+// 保存できたらジャーナルは要らない
+void editorJournalRemove() {
+    if (E.journal_fd == -1) return;
+    if (E.journal_path) unlink(E.journal_path);
+    close(E.journal_fd);
+    E.journal_fd = -1;
+    E.journal_buf.len = 0;
+    E.undo_n = E.undo_done = 0;
+    E.step_open = 0;
+}
+
+// これから始めるコマンドの区切り。cont なら前のコマンドと同じ単位で元に戻す
+void editorJournalBegin(int cont) {
+    if (cont) return;
+    E.step_open = 0;
+    E.step_cy = E.cy;
+    E.step_cx = E.cx;
+}
+
+// 記録1つを ab に足す
+void editorJournalAppendTo(struct abuf *ab, struct jrecord *h, const char *old, const char *new) {
+    uint64_t c = editorHashBytes(14695981039346656037ULL, (const char *)h + 4, sizeof(*h) - 4);
+    c = editorHashBytes(c, old, h->oldlen);
+    c = editorHashBytes(c, new, h->newlen);
+    h->check = (uint32_t)c;
+    abAppend(ab, (const char *)h, sizeof(*h));
+    if (h->oldlen) abAppend(ab, old, h->oldlen);
+    if (h->newlen) abAppend(ab, new, h->newlen);
+}
+
+void editorJournalAppend(struct jrecord *h, const char *old, const char *new) {
+    editorJournalAppendTo(&E.journal_buf, h, old, new);
+}
+
+// at から始まるコマンドを元に戻せるものとして積む (やり直せる分は捨てる)
+void editorJournalPush(size_t at) {
+    if (E.undo_done == E.undo_cap) {
+        E.undo_cap = E.undo_cap ? E.undo_cap * 2 : 64;
+        E.undo_steps = realloc(E.undo_steps, sizeof(size_t) * E.undo_cap);
+        if (!E.undo_steps) die("realloc");
+    }
+    E.undo_steps[E.undo_done++] = at;
+    E.undo_n = E.undo_done;
+}
+
+// 記録を足す前に呼ぶ。コマンドの最初の操作の前には区切りを入れる。記録できなければ0
+int editorJournalStepOpen() {
+    if (editorJournalOpen() == -1) return 0;
+    if (!E.step_open) {
+        struct jrecord st;
+        memset(&st, 0, sizeof(st));
+        st.type = JR_STEP;
+        st.row = E.step_cy;
+        st.col = E.step_cx;
+        editorJournalPush(E.journal_end + E.journal_buf.len);
+        editorJournalAppend(&st, NULL, NULL);
+        E.step_open = 1;
+    }
+    return 1;
+}
+
+// 操作を1つ記録する
+void editorJournalPut(struct jrecord *h, const char *old, const char *new) {
+    if (!editorJournalStepOpen()) return;
+    editorJournalAppend(h, old, new);
+    if (E.journal_buf.len >= JOURNAL_FLUSH) editorJournalWrite();
+}
+
+// 置換のワーカーが editorJournalAppendTo で溜めた記録 recs[0..len) を今のコマンドに足す
+void editorJournalPutBatch(const char *recs, size_t len) {
+    if (E.journal_mute || len == 0 || !editorJournalStepOpen()) return;
+    // 大きければ溜めずにそのまま書く
+    editorJournalWrite();
+    if (len < JOURNAL_FLUSH) {
+        abAppend(&E.journal_buf, recs, len);
+        return;
+    }
+    if (E.journal_fd == -1) return;
+    struct abuf tmp = E.journal_buf;
+    E.journal_buf = (struct abuf){(char *)recs, (int)len, (int)len};
+    editorJournalWrite();
+    E.journal_buf = tmp;
+}
+
+// y行目の col からの old[0..oldlen) を s[0..len) に置き換えた
+void editorJournalSplice(rownum y, int col, const char *old, int oldlen, const char *s, int len) {
+    if (E.journal_mute) return;
+    struct jrecord h;
+    memset(&h, 0, sizeof(h));
+    h.type = JR_SPLICE;
+    h.row = y;
+    h.col = col;
+    h.oldlen = oldlen;
+    h.newlen = len;
+    editorJournalPut(&h, old, s);
+}
+
+// y行目に s[0..len) の行を入れた (JR_INSROW)、または中身が s の y行目を消した (JR_DELROW)
+void editorJournalRow(int type, rownum y, int eol, const char *s, size_t len) {
+    if (E.journal_mute) return;
+    struct jrecord h;
+    memset(&h, 0, sizeof(h));
+    h.type = type;
+    h.row = y;
+    h.eol = eol;
+    if (type == JR_INSROW) h.newlen = len;
+    else h.oldlen = len;
+    editorJournalPut(&h, type == JR_DELROW ? s : NULL, type == JR_INSROW ? s : NULL);
+}
+
+// y行目の改行コードを old から eol にした
+void editorJournalEol(rownum y, int old, int eol) {
+    if (E.journal_mute) return;
+    struct jrecord h;
+    memset(&h, 0, sizeof(h));
+    h.type = JR_EOL;
+    h.row = y;
+    h.eol = old;
+    h.eol2 = eol;
+    editorJournalPut(&h, NULL, NULL);
+}
+
+// 元に戻した (JR_UNDO)・やり直した (JR_REDO) ことを記録する。次の編集は新しいコマンドになる
+void editorJournalMark(int type) {
+    E.step_open = 0;
+    if (E.journal_mute || E.journal_fd == -1) return;
+    struct jrecord h;
+    memset(&h, 0, sizeof(h));
+    h.type = type;
+    editorJournalAppend(&h, NULL, NULL);
+}
+
+// 保存が終わった。写しを取った mark より後ろの記録が、保存したファイルに対する編集になる。
+// 次に開いたときは、ファイルがこのとき保存したものなら mark から先をたどり直す
+void editorJournalSaved(size_t mark) {
+    if (E.journal_mute || E.journal_fd == -1 || !E.filename) return;
+    int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == -1) st.st_size = -1;
+    else if (st.st_size > 0) map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (st.st_size < 0 || (map == MAP_FAILED && st.st_size > 0)) return;
+    uint64_t v[2] = {editorSampleHashOf(map == MAP_FAILED ? NULL : map, st.st_size), mark};
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+
+    struct jrecord h;
+    memset(&h, 0, sizeof(h));
+    h.type = JR_SAVE;
+    h.row = st.st_size;
+    h.newlen = sizeof(v);
+    editorJournalAppend(&h, NULL, (const char *)v);
+}
+
+// *pos の記録を読んで h と data (old, new の順) に入れ、*pos を進める。
+// ファイルの終わりや壊れた記録なら0を返す
+int editorJournalRead(int fd, size_t *pos, struct jrecord *h, struct abuf *data) {
+    if (pread(fd, h, sizeof(*h), *pos) != (ssize_t)sizeof(*h)) return 0;
+    size_t len = (size_t)h->oldlen + h->newlen;
+    if (h->type < JR_STEP || h->type > JR_SAVE || len > INT_MAX / 2) return 0;
+    if (len > (size_t)data->cap) {
+        char *b = realloc(data->b, len);
+        if (!b) return 0;
+        data->b = b;
+        data->cap = len;
+    }
+    data->len = len;
+    if (len > 0 && pread(fd, data->b, len, *pos + sizeof(*h)) != (ssize_t)len) return 0;
+    uint64_t c = editorHashBytes(14695981039346656037ULL, (const char *)h + 4, sizeof(*h) - 4);
+    c = editorHashBytes(c, data->b, len);
+    if (h->check != (uint32_t)c) return 0;
+    *pos += sizeof(*h) + len;
+    return 1;
+}
+
+// 記録した操作 h (中身は data) を行う。undo なら逆向きに行う。
+// 今の内容に当てはまらなければ-1
+int editorJournalApply(const struct jrecord *h, const char *data, int undo) {
+    // 逆向きは old と new を入れ替え、行の挿入と削除を入れ替える
+    const char *s = undo ? data : data + h->oldlen;
+    int oldlen = undo ? h->newlen : h->oldlen;
+    int len = undo ? h->oldlen : h->newlen;
+    int type = h->type;
+    if (undo && type == JR_INSROW) type = JR_DELROW;
+    else if (undo && type == JR_DELROW) type = JR_INSROW;
+
+    rownum y = h->row;
+    erow tmp;
+    erow *row = editorRowGet(y, &tmp);
+    switch (type) {
+        case JR_SPLICE:
+            if (!row || h->col < 0 || h->col > row->len || oldlen > row->len - h->col) return -1;
+            editorRowDeleteRange(y, h->col, oldlen);
+            editorRowInsertString(y, h->col, s, len);
+            editorFilterUpdate(y);
+            break;
+        case JR_INSROW:
+            if (y < 0 || y > E.numrows) return -1;
+            editorInsertRow(y, (char *)s, len);
+            editorRowSetEol(y, h->eol);
+            break;
+        case JR_DELROW:
+            if (!row) return -1;
+            editorDelRow(y);
+            break;
+        case JR_EOL:
+            if (!row) return -1;
+            editorRowSetEol(y, undo ? h->eol : h->eol2);
+            break;
+    }
+    return 0;
+}
+
+// undo_steps[i] のコマンドを元に戻す (undo) か、もう一度行う
+void editorJournalStep(size_t i, int undo) {
+    editorJournalWrite();
+    if (E.journal_fd == -1) return;
+    // 区切りの後ろから、次の区切りか印の手前までがこのコマンドの操作
+    size_t pos = E.undo_steps[i];
+    struct jrecord st, h;
+    struct abuf ops = ABUF_INIT, data = ABUF_INIT, one = ABUF_INIT;
+    if (!editorJournalRead(E.journal_fd, &pos, &st, &one) || st.type != JR_STEP) return;
+    while (editorJournalRead(E.journal_fd, &pos, &h, &one)) {
+        // 保存の印は打ち込みの途中に入ることがある
+        if (h.type == JR_SAVE) continue;
+        if (h.type < JR_SPLICE || h.type > JR_EOL) break;
+        abAppend(&ops, (char *)&h, sizeof(h));
+        if (one.len) abAppend(&data, one.b, one.len);
+    }
+
+    int n = ops.len / (int)sizeof(h);
+    size_t off = undo ? (size_t)data.len : 0;
+    E.journal_mute++;
+    for (int k = 0; k < n; k++) {
+        memcpy(&h, ops.b + (undo ? n - 1 - k : k) * sizeof(h), sizeof(h));
+        if (undo) off -= (size_t)h.oldlen + h.newlen;
+        editorJournalApply(&h, data.b ? data.b + off : "", undo);
+        if (!undo) off += (size_t)h.oldlen + h.newlen;
+    }
+    E.journal_mute--;
+
+    // 元に戻したらコマンドの前の位置へ、やり直したら最後に変えた位置へ
+    if (undo) {
+        E.cy = st.row;
+        E.cx = st.col;
+    } else if (n > 0) {
+        E.cy = h.row;
+        E.cx = h.type == JR_SPLICE ? h.col + (int)h.newlen : 0;
+    }
+    if (E.cy >= E.numrows) E.cy = E.numrows - 1;
+    if (E.cy < 0) E.cy = 0;
+    erow tmp;
+    erow *row = editorRowGet(E.cy, &tmp);
+    if (!row || E.cx > row->len) E.cx = row ? row->len : 0;
+    abFree(&ops);
+    abFree(&data);
+    abFree(&one);
+}
+
+void editorUndo() {
+    if (E.undo_done == 0) return;
+    editorJournalStep(--E.undo_done, 1);
+    editorJournalMark(JR_UNDO);
+}
+
+void editorRedo() {
+    if (E.undo_done == E.undo_n) return;
+    editorJournalStep(E.undo_done++, 0);
+    editorJournalMark(JR_REDO);
+}
+
+// 前回の編集の記録が残っていれば、取り戻すか尋ねる
+void editorJournalRecover() {
+    if (!E.journal_path) return;
+    int fd = open(E.journal_path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return;
+    if (editorJournalLock(fd) == -1) {
+        // 別の slit が同じファイルを編集している: 横には置かず一時ファイルを使う
+        close(fd);
+        free(E.journal_path);
+        E.journal_path = NULL;
+        return;
+    }
+
+    // 元ファイルが記録を始めたときのまま (か、追記されただけ) なら記録をたどれる。
+    // 途中で保存していれば、最後に保存したときのファイルと比べ、その写しを取った
+    // 位置 start から先をたどる
+    struct jheader hd;
+    int valid = pread(fd, &hd, sizeof(hd), 0) == (ssize_t)sizeof(hd) && hd.magic == JOURNAL_MAGIC;
+    size_t have = E.map ? E.maplen : 0;
+    int match = valid && hd.base <= have && editorSampleHash(hd.base) == hd.samplehash;
+    struct jrecord h;
+    struct abuf data = ABUF_INIT;
+    size_t pos = sizeof(hd), start = sizeof(hd);
+    while (valid && editorJournalRead(fd, &pos, &h, &data)) {
+        if (h.type != JR_SAVE || data.len != 2 * sizeof(uint64_t)) continue;
+        uint64_t v[2];
+        memcpy(v, data.b, sizeof(v));
+        match = h.row >= 0 && (size_t)h.row <= have && editorSampleHash(h.row) == v[0];
+        start = v[1];
+    }
+    long long steps = 0;
+    pos = sizeof(hd);
+    for (size_t at = pos; match && editorJournalRead(fd, &pos, &h, &data); at = pos)
+        if (at >= start && (h.type == JR_STEP || h.type == JR_UNDO || h.type == JR_REDO)) steps++;
+    if (match && steps == 0) {
+        unlink(E.journal_path);
+        close(fd);
+        abFree(&data);
+        return;
+    }
+
+    char msg[128];
+    if (match) {
+        snprintf(msg, sizeof(msg), "Recover %lld unsaved edit%s? (y/n)", steps, steps > 1 ? "s" : "");
+    } else {
+        snprintf(msg, sizeof(msg), "Unsaved edits do not match the file. Discard? (y/n)");
+    }
+    int c;
+    do {
+        editorDrawPrompt(msg);
+        c = editorReadKey();
+    } while (c != 'y' && c != 'n');
+
+    if (!match || c == 'n') {
+        if (match || c == 'y') {
+            unlink(E.journal_path);
+        } else {
+            // 消さずに残し、この回は一時ファイルに記録する
+            free(E.journal_path);
+            E.journal_path = NULL;
+        }
+        close(fd);
+        abFree(&data);
+        return;
+    }
+
+    // 記録をたどり直す。途中で壊れていたらそこから先は捨てる
+    E.journal_fd = fd;
+    E.journal_mute++;
+    size_t good = pos = sizeof(hd);
+    while (editorJournalRead(fd, &pos, &h, &data)) {
+        // 保存済みの記録は行わず、元に戻す履歴だけを作り直す
+        int live = good >= start;
+        if (h.type == JR_STEP) {
+            editorJournalPush(good);
+        } else if (h.type == JR_UNDO) {
+            if (E.undo_done > 0) {
+                E.undo_done--;
+                if (live) editorJournalStep(E.undo_done, 1);
+            }
+        } else if (h.type == JR_REDO) {
+            if (E.undo_done < E.undo_n) {
+                if (live) editorJournalStep(E.undo_done, 0);
+                E.undo_done++;
+            }
+        } else if (h.type == JR_SAVE || !live) {
+            // 何もしない
+        } else {
+            if (editorJournalApply(&h, data.b ? data.b : "", 0) == -1) break;
+            E.cy = h.row;
+        }
+        good = pos;
+    }
+    E.journal_mute--;
+    if (ftruncate(fd, good) == -1) {}
+    E.journal_end = good;
+    E.dirty++;
+    if (E.cy >= E.numrows) E.cy = E.numrows - 1;
+    E.cx = 0;
+    abFree(&data);
+}
+
+// --- 修正版 editorOpen (v0.6) ---
+void editorOpen(char *filename) {
+    FILE *fp;
+    
+    // ★修正ポイント: ファイル名がなく、かつ標準入力が端末(TTY)の場合
+    // パイプラインの先頭 (slit | cat) または単独起動 (slit) なので、
+    // 入力を待たずに「空のドキュメント」として開始する。
+    if (!filename && isatty(STDIN_FILENO)) {
+        editorInsertRow(0, "", 0);
+        return;
+    }
+
+    if (filename) {
+        // ファイルモード
+        free(E.filename);
+        E.filename = strdup(filename);
+
+        int fd = open(filename, O_RDONLY);
+        if (fd == -1) {
+            editorInsertRow(0, "", 0);
+            return;
+        }
+        // 通常ファイルはmmapして改行索引だけを作る (巨大ファイルでも即起動)
+        if (editorMapFile(fd)) {
+            // 保存時に未編集部分をコピーするため開いたままにしておく
+            E.src_fd = fd;
+            if (E.numrows == 0) {
+                // 空のファイル (--follow のときだけここに来る)
+                editorInsertRow(0, "", 0);
+                editorRowAt(0)->eol = EOL_NONE;
+            }
+            return;
+        }
+        // FIFOなど巻き戻せないものもあるので、バイナリチェックは読みながら行う
+        fp = fdopen(fd, "r");
+    } else {
+        // パイプモード: 標準入力から読む
+        // (isattyチェックを抜けたということは、ここはパイプからの入力)
+        // 入力の終わりを待たずに編集を始め、届いた行はメインループで追加する
+        E.filename = NULL;
+        E.stream_fd = STDIN_FILENO;
+        return;
+    }
+
+    if (!fp) {
+        if (filename) editorInsertRow(0, "", 0); 
+        return; 
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        if (memchr(line, '\0', linelen)) {
+            fprintf(stderr, "slit: Binary file detected. Cannot edit.\n");
+            exit(1);
+        }
+        int eol = EOL_NONE;
+        if (line[linelen - 1] == '\n') {
+            eol = linelen > 1 && line[linelen - 2] == '\r' ? EOL_CRLF : EOL_LF;
+            linelen -= eol;
+            if (E.numrows == 0) E.eol = eol;
+        }
+        editorInsertRow(E.numrows, line, linelen);
+        editorRowAt(E.numrows - 1)->eol = eol;
+        if (editorUtf8Check(line, linelen) != (size_t)linelen && E.bad_rows++ == 0)
+            E.bad_line = E.numrows - 1;
+    }
+    free(line);
+    
+    if (filename) fclose(fp);
+    
+    if (E.numrows == 0) {
+        editorInsertRow(0, "", 0);
+        editorRowAt(0)->eol = EOL_NONE;
+    }
+}
+
+// 全行をストリームへ書き出す
+// 未編集で、元ファイルの内容 (改行コードまで) をそのまま書き戻せる行なら1
+int editorRowClean(erow *row) {
+    return E.src_fd != -1 && !row->chars;
+}
+
+#define SAVE_REPORT ((size_t)1 << 22)   // これだけ書くごとに進み具合を知らせる
+
+// 裏で保存している子プロセスでは、書いたバイト数を親に知らせる (editorSaveStart)
+void editorSaveProgress(size_t len) {
+    if (E.save_pid != 0) return;
+    size_t old = E.save_done;
+    E.save_done += len;
+    // 親が読んでいなくて溢れた知らせは捨ててよい
+    if (old / SAVE_REPORT != E.save_done / SAVE_REPORT &&
+        write(E.save_fd, &E.save_done, sizeof(E.save_done)) == -1) {}
+}
+
+// 元ファイルの [off, off + len) を fp へ書く。Linuxではカーネル内でコピーする
+int editorCopyRange(FILE *fp, size_t off, size_t len) {
+#ifdef __linux__
+    if (fflush(fp) == EOF) return -1;
+    off_t pos = off;
+    while (len > 0) {
+        ssize_t n = sendfile(fileno(fp), E.src_fd, &pos, len < SAVE_REPORT ? len : SAVE_REPORT);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;  // 使えなければ残りは普通に書く
+        len -= n;
+        editorSaveProgress(n);
+    }
+    off = pos;
+#endif
+    while (len > 0) {
+        size_t n = len < SAVE_REPORT ? len : SAVE_REPORT;
+        if (fwrite(E.map + off, 1, n, fp) != n) return -1;
+        off += n;
+        len -= n;
+        editorSaveProgress(n);
+    }
+    return 0;
+}
+
+int editorWriteRows(FILE *fp) {
+    // 元ファイル上で連続している未編集行はまとめてコピーする
+    size_t run = 0, runlen = 0;
+    for (rownum i = 0; i < E.numrows; i++) {
+        erow tmp;
+        erow *row = editorRowGet(i, &tmp);
+        if (editorRowClean(row)) {
+            if (runlen == 0 || run + runlen != row->off) {
+                if (runlen && editorCopyRange(fp, run, runlen) == -1) return -1;
+                run = row->off;
+                runlen = 0;
+            }
+            runlen += row->len + row->eol;
+            continue;
+        }
+        if (runlen && editorCopyRange(fp, run, runlen) == -1) return -1;
+        runlen = 0;
+
+        const char *a, *b;
+        int alen, blen;
+        editorRowSpans(row, &a, &alen, &b, &blen);
+        if (fwrite(a, 1, alen, fp) != (size_t)alen) return -1;
+        if (blen && fwrite(b, 1, blen, fp) != (size_t)blen) return -1;
+        if (fputs(editorEolChars(row->eol), fp) == EOF) return -1;
+        editorSaveProgress(alen + blen + row->eol);
+    }
+    if (runlen && editorCopyRange(fp, run, runlen) == -1) return -1;
+    return 0;
+}
+
+// 未編集行がすべて元の位置に残っていて全体の長さも変わらない (編集が同じ長さの
+// 置き換えだけ) なら、編集した行だけを元ファイルへ直接書き込む。
+// 書けたら1、条件を満たさなければ0を返す
+int editorSaveInPlace(const char *path) {
+    if (E.src_fd == -1) return 0;
+
+    size_t pos = 0;
+    for (rownum i = 0; i < E.numrows; i++) {
+        erow tmp;
+        erow *row = editorRowGet(i, &tmp);
+        if (editorRowClean(row) && row->off != pos) return 0;
+        pos += row->len + row->eol;
+    }
+    if (pos != E.maplen) return 0;
+
+    // 開いた後に置き換えられたファイルには書かない
+    int fd = open(path, O_WRONLY);
+    if (fd == -1) return 0;
+    struct stat st, src;
+    if (fstat(fd, &st) == -1 || fstat(E.src_fd, &src) == -1 ||
+        st.st_dev != src.st_dev || st.st_ino != src.st_ino || (size_t)st.st_size != E.maplen) {
+        close(fd);
+        return 0;
+    }
+
+    // 隣り合う編集行はまとめて書く。失敗しても未編集行の領域には触れていない
+    // ので、呼び出し元は一時ファイル経由でやり直せる
+    struct abuf ab = ABUF_INIT;
+    size_t start = 0;
+    int ok = 1;
+    pos = 0;
+    for (rownum i = 0; i < E.numrows && ok; i++) {
+        erow tmp;
+        erow *row = editorRowGet(i, &tmp);
+        if (editorRowClean(row) || ab.len > (1 << 20)) {
+            if (ab.len && editorPwriteAll(fd, ab.b, ab.len, start) == -1) ok = 0;
+            ab.len = 0;
+        }
+        if (!editorRowClean(row)) {
+            const char *a, *b;
+            int alen, blen;
+            editorRowSpans(row, &a, &alen, &b, &blen);
+            if (ab.len == 0) start = pos;
+            // ギャップが先頭にあるときやmmap上の行では片側が空 (NULL) になる
+            if (alen) abAppend(&ab, a, alen);
+            if (blen) abAppend(&ab, b, blen);
+            abAppend(&ab, editorEolChars(row->eol), row->eol);
+        }
+        pos += row->len + row->eol;
+    }
+    if (ok && ab.len && editorPwriteAll(fd, ab.b, ab.len, start) == -1) ok = 0;
+    abFree(&ab);
+    if (ok && fsync(fd) == -1) ok = 0;
+    close(fd);
+    return ok;
+}
+
+// 保存する。失敗したら-1
+int editorSave() {
+    if (!E.filename) {
+        // パイプモード: 標準出力へ書き出す
+        // stdoutの場合は閉じない（呼び出し元が閉じる）
+        return editorWriteRows(stdout) == 0 && fflush(stdout) != EOF ? 0 : -1;
+    }
+
+    // 追従中なら最後に届いた分まで取り込んでから書く
+    editorFollow();
+    char *path = realpath(E.filename, NULL);
+    if (!path) path = strdup(E.filename);
+    if (editorSaveInPlace(path)) {
+        free(path);
+        return 0;
+    }
+
+    // 未編集行は元ファイルのmmap領域を参照しているため、元ファイルを
+    // その場で切り詰めると読み出し中に壊れる。一時ファイルに書いてからrenameする
+
+    size_t tmplen = strlen(path) + 16;
+    char *tmp = malloc(tmplen);
+    snprintf(tmp, tmplen, "%s.slitXXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        free(path);
+        return -1;
+    }
+
+    // パーミッションは元ファイルに合わせる (新規ファイルならumaskに従う)
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+
+    FILE *fp = fdopen(fd, "w");
+    int ok = fp != NULL && editorWriteRows(fp) == 0;
+    // 書いている間に元ファイルが切り詰められていたら、未編集行は0で埋まっている
+    if (E.map_lost) ok = 0;
+    // rename の前にディスクへ届けておく (途中で落ちても元ファイルは無傷)
+    if (ok && (fflush(fp) == EOF || fsync(fd) == -1)) ok = 0;
+    if (fp) {
+        if (fclose(fp) == EOF) ok = 0;
+    } else {
+        close(fd);
+    }
+
+    if (!ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+        ok = 0;
+    } else {
+        editorDropIndexCache();
+    }
+    free(tmp);
+    free(path);
+    return ok ? 0 : -1;
+}
+
+// --- 裏での保存 ---
+// ファイルモードの保存は fork した子プロセスに任せる。子はその時点の行ストアの写し
+// (コピーオンライト) から書くので、親はすぐに編集に戻れる。Ctrl+S は編集を続けたまま
+// 保存し、ESC は端末をすぐに戻してから、進み具合を出しつつ書き終わるのを待つ。
+// 子は書いたバイト数をパイプで知らせ、成否は終了ステータスで返す
+
+#define SAVE_SHOW_MS 200    // ESC の保存がこれより長引いたら進み具合を出す
+
+// 書き終えた割合 (元のファイルの大きさに対する%)。わからなければ-1
+int editorSavePercent() {
+    if (E.maplen == 0) return -1;
+    size_t pct = E.save_done / (E.maplen / 100 + 1);
+    return pct > 99 ? 99 : (int)pct;
+}
+
+// 保存する子プロセスを起こす。final なら保存できたらジャーナルも消す。起こせなければ-1
+int editorSaveStart(int final) {
+    // 追従中なら最後に届いた分まで取り込んでから写しを取る
+    editorFollow();
+    E.save_mark = E.journal_fd != -1 ? E.journal_end + E.journal_buf.len : sizeof(struct jheader);
+    E.save_dirty = E.dirty;
+    int fds[2];
+    if (pipe(fds) == -1) return -1;
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // 端末が閉じても Ctrl+C でも書き終える。端末の設定は親に任せる
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGTERM, SIG_DFL);
+        close(fds[0]);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        E.save_pid = 0;
+        E.save_fd = fds[1];
+        E.save_done = 0;
+        E.follow = 0;
+        E.tty_fd = -1;
+        E.journal_fd = -1;
+        int ok = editorSave() == 0;
+        if (ok && final && E.journal_path) unlink(E.journal_path);
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    E.save_pid = pid;
+    E.save_fd = fds[0];
+    E.save_done = 0;
+    return 0;
+}
+
+// 保存が終わった。写しを取った後の編集だけが保存していない編集になる
+void editorSaveFinish(int ok) {
+    E.save_result = ok ? 0 : -1;
+    if (!ok) {
+        snprintf(E.notice, sizeof(E.notice), "save failed");
+        return;
+    }
+    E.dirty = E.dirty > E.save_dirty ? E.dirty - E.save_dirty : 0;
+    editorJournalSaved(E.save_mark);
+    snprintf(E.notice, sizeof(E.notice), "saved");
+
+    // 追従中のファイルを置き換えたなら、編集が残っていなければ開き直す
+    struct stat st, cur;
+    if (E.follow && fstat(E.src_fd, &cur) == 0 &&
+        (stat(E.filename, &st) == -1 || st.st_dev != cur.st_dev || st.st_ino != cur.st_ino)) {
+        int fd = E.dirty ? -1 : open(E.filename, O_RDONLY);
+        if (fd != -1) editorFollowReload(fd);
+        else editorFollowStop("saved; follow stopped");
+    }
+}
+
+// 親プロセス側: 子プロセスからの知らせを読む。表示を更新すべきなら1を返す
+int editorSaveCheck() {
+    if (E.save_pid <= 0) return 0;
+    size_t buf[512];
+    ssize_t n;
+    int changed = 0;
+    while ((n = read(E.save_fd, buf, sizeof(buf))) >= (ssize_t)sizeof(size_t)) {
+        E.save_done = buf[n / sizeof(size_t) - 1];
+        changed = 1;
+    }
+    if (n != 0) return changed;
+
+    // 子プロセスが書き終えて閉じた
+    int status;
+    while (waitpid(E.save_pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            status = 1 << 8;
+            break;
+        }
+    }
+    close(E.save_fd);
+    E.save_fd = -1;
+    E.save_pid = -1;
+    editorSaveFinish(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return 1;
+}
+
+// 裏での保存が終わるのを待つ。show なら長引いたときに進み具合を端末に出す
+void editorSaveWait(int show) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int shown = -2;     // 最後に出した割合 (-2ならまだ出していない)
+    while (E.save_pid > 0) {
+        struct pollfd pfd = {E.save_fd, POLLIN, 0};
+        if (poll(&pfd, 1, SAVE_SHOW_MS) == -1 && errno != EINTR) die("poll");
+        editorSaveCheck();
+        if (!show || E.save_pid <= 0) continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        int pct = editorSavePercent();
+        if (ms < SAVE_SHOW_MS || pct == shown) continue;
+        char msg[64];
+        int len = pct >= 0 ? snprintf(msg, sizeof(msg), "\rslit: saving... %d%%\x1b[K", pct)
+                           : snprintf(msg, sizeof(msg), "\rslit: saving...\x1b[K");
+        tty_write(msg, len);
+        shown = pct;
+    }
+    if (shown != -2) tty_write("\r\x1b[K", 4);
+}
+
+// Ctrl+S: 編集を続けたまま保存する
+void editorSaveBackground() {
+    if (!E.filename) return;
+    if (E.save_pid > 0) {
+        snprintf(E.notice, sizeof(E.notice), "still saving");
+        return;
+    }
+    if (editorSaveStart(0) == -1) {
+        editorSaveFinish(editorSave() == 0);
+        return;
+    }
+    // スクリプト実行では書き終わってから次のキーへ進む
+    if (E.script) editorSaveWait(0);
+}
+
+// ESC (ファイルモード): 端末を戻して保存し、結果を終了ステータスにして終わる
+void editorSaveAndExit() {
+    tty_write("\r\n", 2);
+    disableRawMode();
+    // 途中の保存が後から古い内容で上書きしないよう、先に終わらせる
+    editorSaveWait(1);
+    if (editorSaveStart(1) == 0) {
+        // 終わるだけなので、置き換えたファイルを開き直すことはない
+        E.follow = 0;
+        editorSaveWait(1);
+    } else {
+        E.save_result = editorSave();
+    }
+    if (E.save_result == -1) {
+        // 保存できなかった編集は記録に残す (次に開いたときに取り戻せる)
+        editorJournalSync();
+        if (E.journal_path && E.journal_fd != -1) {
+            fprintf(stderr, "slit: %s: cannot save; edits are kept in %s\n", E.filename, E.journal_path);
+        } else {
+            fprintf(stderr, "slit: %s: cannot save\n", E.filename);
+        }
+        exit(1);
+    }
+    editorJournalRemove();
+    exit(0);
+}
+
+// --- 検索 ---
+// Ctrl+F のインクリメンタル検索。行を検索順に並べて区間に分け、大きなバッファでは
+// 区間ごとにワーカースレッドで探す。手前の区間がすべて外れた区間のヒットは、
+// 残りの区間を待たずにその場で表示する。探している間もキー入力は受け付け、
+// 入力が変われば古い検索は打ち切る
+
+#define SEARCH_BG_ROWS 65536    // これより行数が多ければ裏のスレッドで探す
+
+// hay[0..hlen) の中で最初に needle[0..nlen) が現れる位置 (なければNULL)。
+// 先頭と末尾のバイトが両方一致する候補だけを、まとめてSIMDで絞り込む
+const char *editorMemmem(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+    if (nlen == 0) return hay;
+    if (nlen > hlen) return NULL;
+    size_t last = hlen - nlen;  // 候補の最後の位置
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i vf = _mm256_set1_epi8(needle[0]), vl = _mm256_set1_epi8(needle[nlen - 1]);
+    for (; i + 31 <= last; i += 32) {
+        __m256i f = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(hay + i)), vf);
+        __m256i l = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(hay + i + nlen - 1)), vl);
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(f, l));
+        while (mask) {
+            size_t at = i + editorCtz64(mask);
+            if (nlen <= 2 || memcmp(hay + at + 1, needle + 1, nlen - 2) == 0) return hay + at;
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i vf = _mm_set1_epi8(needle[0]), vl = _mm_set1_epi8(needle[nlen - 1]);
+    for (; i + 15 <= last; i += 16) {
+        __m128i f = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(hay + i)), vf);
+        __m128i l = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(hay + i + nlen - 1)), vl);
+        uint64_t mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(f, l));
+        while (mask) {
+            size_t at = i + editorCtz64(mask);
+            if (nlen <= 2 || memcmp(hay + at + 1, needle + 1, nlen - 2) == 0) return hay + at;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (i <= last) {
+        const char *p = memchr(hay + i, needle[0], last - i + 1);
+        if (!p) return NULL;
+        if (memcmp(p, needle, nlen) == 0) return p;
+        i = p - hay + 1;
+    }
+    return NULL;
+}
+
+// 行の中で needle が現れる位置。dir > 0 なら from 以降で最初、dir < 0 なら
+// from より前で最後のもの (なければ -1)。ギャップは動かさないので
+// ワーカースレッドからも呼べる
+int editorRowSearch(erow *row, const char *needle, int nlen, int from, int dir) {
+    if (dir < 0) {
+        int last = -1, at = 0;
+        while ((at = editorRowSearch(row, needle, nlen, at, 1)) != -1 && at < from) {
+            last = at;
+            at++;
+        }
+        return last;
+    }
+    if (from < 0) from = 0;
+    if (from + nlen > row->len) return -1;
+
+    const char *a, *b;
+    int alen, blen;
+    editorRowSpans(row, &a, &alen, &b, &blen);
+    if (from < alen) {
+        const char *p = editorMemmem(a + from, alen - from, needle, nlen);
+        if (p) return p - a;
+        // ギャップをまたぐ一致
+        for (int s = alen - nlen + 1 > from ? alen - nlen + 1 : from; s < alen; s++) {
+            if (s + nlen > row->len) break;
+            int k = alen - s;
+            if (memcmp(a + s, needle, k) == 0 && memcmp(b, needle + k, nlen - k) == 0) return s;
+        }
+        from = alen;
+    }
+    if (from + nlen > row->len) return -1;
+    const char *p = editorMemmem(b + (from - alen), blen - (from - alen), needle, nlen);
+    return p ? alen + (int)(p - b) : -1;
+}
+
+struct searchjob;
+
+struct searchslice {
+    struct searchjob *job;
+    rownum from, count;     // 検索順で from 番目から count 行
+    rownum hit_row;         // 見つけた位置 (hit_row < 0 ならなし)
+    int hit_col;
+    int done;
+};
+
+struct searchjob {
+    pthread_mutex_t lock;   // slice の結果と best, cancel を守る
+    char *needle;
+    int nlen;
+    int dir;        // 1なら前方、-1なら後方
+    rownum origin;  // この行の次 (後方なら前) から順に探す
+    rownum numrows;
+    int nslices;
+    struct searchslice slice[PAR_MAX_THREADS];
+    pthread_t th[PAR_MAX_THREADS];
+    int started[PAR_MAX_THREADS];
+    int best;       // ヒットした区間の最小の番号 (nslices ならまだない)
+    int cancel;
+    int notify;     // 区間が終わるたびに1バイト書く (-1なら同期実行)
+};
+
+// 検索順で k 番目の行 (起点の行を除いて一周する)
+rownum editorSearchRowIndex(struct searchjob *job, rownum k) {
+    rownum n = job->numrows;
+    if (job->dir > 0) return (job->origin + 1 + k) % n;
+    return ((job->origin - 1 - k) % n + n) % n;
+}
+
+void *editorSearchWorker(void *arg) {
+    struct searchslice *sl = arg;
+    struct searchjob *job = sl->job;
+    int idx = sl - job->slice;
+    lsnode *leaf = NULL;
+    rownum start = 0;
+    for (rownum k = sl->from; k < sl->from + sl->count; k++) {
+        rownum at = editorSearchRowIndex(job, k);
+        if (!leaf || at < start || at >= start + leaf->n) {
+            // 葉を移るたびに、打ち切りと手前の区間でのヒットを確かめる
+            pthread_mutex_lock(&job->lock);
+            int stop = job->cancel || job->best < idx;
+            pthread_mutex_unlock(&job->lock);
+            if (stop) break;
+            leaf = lsLeafFind(at, &start);
+        }
+        erow tmp;
+        erow *row = editorRowDecode(leaf->u.rows[at - start], &tmp);
+        int col = editorRowSearch(row, job->needle, job->nlen, job->dir > 0 ? 0 : row->len + 1, job->dir);
+        if (col >= 0) {
+            pthread_mutex_lock(&job->lock);
+            sl->hit_row = at;
+            sl->hit_col = col;
+            if (idx < job->best) job->best = idx;
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+    pthread_mutex_lock(&job->lock);
+    sl->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    if (job->notify != -1 && write(job->notify, "", 1) == -1) {
+        // パイプが詰まっていても結果は後で読める
+    }
+    return NULL;
+}
+
+// 実行中の検索を打ち切って片付ける
+void editorSearchStop() {
+    struct searchjob *job = E.search;
+    if (!job) return;
+    pthread_mutex_lock(&job->lock);
+    job->cancel = 1;
+    pthread_mutex_unlock(&job->lock);
+    for (int i = 0; i < job->nslices; i++)
+        if (job->started[i]) pthread_join(job->th[i], NULL);
+    editorDrainNotify();
+    pthread_mutex_destroy(&job->lock);
+    free(job->needle);
+    free(job);
+    E.search = NULL;
+}
+
+// origin 行を除く全行から needle を探し始める。行数が少なければその場で終わらせる
+void editorSearchStart(const char *needle, int nlen, rownum origin, int dir) {
+    editorSearchStop();
+    struct searchjob *job = calloc(1, sizeof(struct searchjob));
+    if (!job) die("calloc");
+    pthread_mutex_init(&job->lock, NULL);
+    job->needle = malloc(nlen);
+    if (!job->needle) die("malloc");
+    memcpy(job->needle, needle, nlen);
+    job->nlen = nlen;
+    job->dir = dir;
+    job->origin = origin;
+    job->numrows = E.numrows;
+    job->notify = -1;
+    E.search = job;
+
+    rownum total = E.numrows > 0 ? E.numrows - 1 : 0;
+    int bg = total >= SEARCH_BG_ROWS && editorNotifyPipe() != -1;
+    int n = bg ? E.ncpu : 1;
+    if (n > PAR_MAX_THREADS) n = PAR_MAX_THREADS;
+    job->nslices = n;
+    job->best = n;
+    for (int i = 0; i < n; i++) {
+        struct searchslice *sl = &job->slice[i];
+        sl->job = job;
+        sl->from = total * i / n;
+        sl->count = total * (i + 1) / n - sl->from;
+        sl->hit_row = -1;
+    }
+    if (!bg) {
+        editorSearchWorker(&job->slice[0]);
+        return;
+    }
+    job->notify = E.notify_pipe[1];
+    for (int i = 0; i < n; i++) {
+        job->started[i] = pthread_create(&job->th[i], NULL, editorSearchWorker, &job->slice[i]) == 0;
+        if (!job->started[i]) editorSearchWorker(&job->slice[i]);
+    }
+    // スクリプト実行では結果が次のキーとの競争にならないよう、ここで待つ
+    for (int i = 0; E.script && i < n; i++) {
+        if (job->started[i]) pthread_join(job->th[i], NULL);
+        job->started[i] = 0;
+    }
+}
+
+// 検索結果が確定していれば1を返し、*row, *col に位置を入れる (見つからなければ *row = -1)
+int editorSearchResult(rownum *row, int *col) {
+    struct searchjob *job = E.search;
+    int decided = 1;
+    *row = -1;
+    pthread_mutex_lock(&job->lock);
+    for (int i = 0; i < job->nslices; i++) {
+        struct searchslice *sl = &job->slice[i];
+        if (!sl->done) {
+            decided = 0;
+            break;
+        }
+        if (sl->hit_row >= 0) {
+            *row = sl->hit_row;
+            *col = sl->hit_col;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    return decided;
+}
+
+// 見つかった位置へカーソルを動かし、プロンプトの後ろにその行を見せる
+void editorFindShow(rownum row, int col) {
+    E.cy = row;
+    E.cx = col;
+    E.prompt_row = row;
+    E.prompt_col = col;
+    snprintf(E.prompt_info, sizeof(E.prompt_info), "  %lld: ", E.rowbase + row + 1);
+}
+
+// 検索が終わっていれば結果を反映する
+void editorFindApply() {
+    rownum row;
+    int col;
+    if (!E.search) return;
+    if (!editorSearchResult(&row, &col)) {
+        snprintf(E.prompt_info, sizeof(E.prompt_info), "  (searching)");
+        E.prompt_row = -1;
+        return;
+    }
+    struct searchjob *job = E.search;
+    if (row < 0) {
+        // 一周して起点の行の残りへ戻ってくる
+        erow tmp;
+        erow *r = editorRowGet(job->origin, &tmp);
+        if (r) {
+            col = editorRowSearch(r, job->needle, job->nlen, job->dir > 0 ? 0 : r->len + 1, job->dir);
+            if (col >= 0) row = job->origin;
+        }
+    }
+    editorSearchStop();
+    if (row >= 0) {
+        editorFindShow(row, col);
+    } else {
+        E.cx = E.find_cx;
+        E.cy = E.find_cy;
+        E.prompt_row = -1;
+        snprintf(E.prompt_info, sizeof(E.prompt_info), "  (not found)");
+    }
+}
+
+// 行が総入れ替えになる前に検索を止める。やり直すための needle を返す (検索中でなければNULL)
+char *editorSearchSuspend(int *nlen, int *dir, rownum *origin) {
+    struct searchjob *job = E.search;
+    if (!job) return NULL;
+    char *needle = malloc(job->nlen);
+    if (!needle) die("malloc");
+    memcpy(needle, job->needle, job->nlen);
+    *nlen = job->nlen;
+    *dir = job->dir;
+    *origin = job->origin;
+    editorSearchStop();
+    return needle;
+}
+
+// editorSearchSuspend で止めた検索を、入れ替わった行でやり直す (needle は解放する)
+void editorSearchResume(char *needle, int nlen, int dir, rownum origin) {
+    if (!needle) return;
+    if (E.find_cy >= E.numrows) E.find_cy = E.numrows - 1;
+    E.find_cx = 0;
+    E.prompt_row = -1;
+    editorSearchStart(needle, nlen, origin < E.numrows ? origin : E.numrows - 1, dir);
+    free(needle);
+    editorFindApply();
+}
+
+void editorFindCallback(char *query, int key) {
+    if (key == '\r' || key == '\x1b') {
+        editorSearchStop();
+        E.prompt_row = -1;
+        E.prompt_info[0] = '\0';
+        return;
+    }
+    if (key == NOTIFY_KEY) {
+        editorFindApply();
+        return;
+    }
+
+    int nlen = strlen(query);
+    int dir = 1, col = E.find_cx;
+    rownum row = E.find_cy;
+    if (key == ARROW_DOWN || key == ARROW_RIGHT) {
+        // 次のヒット
+        row = E.cy;
+        col = E.cx + 1;
+    } else if (key == ARROW_UP || key == ARROW_LEFT) {
+        // 前のヒット
+        dir = -1;
+        row = E.cy;
+        col = E.cx;
+    }
+    if (nlen == 0 || E.numrows == 0) {
+        editorSearchStop();
+        E.cx = E.find_cx;
+        E.cy = E.find_cy;
+        E.prompt_row = -1;
+        E.prompt_info[0] = '\0';
+        return;
+    }
+    if (row >= E.numrows) row = E.numrows - 1;
+
+    // 起点の行はその場で調べ、残りの行は検索スレッドに任せる
+    erow tmp;
+    erow *r = editorRowGet(row, &tmp);
+    int hit = editorRowSearch(r, query, nlen, col, dir);
+    if (hit >= 0) {
+        editorSearchStop();
+        editorFindShow(row, hit);
+        return;
+    }
+    editorSearchStart(query, nlen, row, dir);
+    editorFindApply();
+}
+
+void editorFind() {
+    int saved_coloff = E.coloff;
+    E.find_cx = E.cx;
+    E.find_cy = E.cy;
+    char *query = editorPrompt("Search: %s", editorFindCallback);
+    if (query) {
+        free(query);
+    } else {
+        E.cx = E.find_cx;
+        E.cy = E.find_cy;
+        E.coloff = saved_coloff;
+    }
+}
+
+// --- 置換 ---
+// Ctrl+R で正規表現 (POSIX ERE) の置換。一致ごとに確かめるか、残りをまとめて置き換える。
+// まとめて置き換えるときは行を区間に分けて並列に処理し、変わった行の中身を
+// 1回で作り直す (1文字ずつ挿入はしない)。画面は最後に1度だけ描き直す
+
+#define REPLACE_PAR_ROWS 65536  // これより行数が多ければ並列に置き換える
+#define REPLACE_NSUB 10         // & (\0) と \1〜\9
+
+// 置換文字列 rep を展開して out に足す。m は base を起点にした一致位置
+void editorExpandReplacement(struct abuf *out, const char *base, const regmatch_t *m, const char *rep) {
+    for (const char *p = rep; *p; p++) {
+        int g = -1;
+        if (*p == '&') {
+            g = 0;
+        } else if (*p == '\\' && p[1] >= '0' && p[1] <= '9') {
+            g = *++p - '0';
+        } else if (*p == '\\' && p[1]) {
+            p++;    // \& や \\ はその文字自身
+        }
+        if (g < 0) abAppend(out, p, 1);
+        else if (m[g].rm_so >= 0) abAppend(out, base + m[g].rm_so, m[g].rm_eo - m[g].rm_so);
+    }
+}
+
+// s[0..len) ('\0'終端) の from バイト目以降の一致を rep で置き換えた行を out に作る。
+// all が0なら最初の1つだけ。置き換えた数を返す (0なら out は空のまま)
+int editorSubstitute(regex_t *re, const char *s, int len, int from, const char *rep, int all, struct abuf *out) {
+    regmatch_t m[REPLACE_NSUB];
+    int count = 0, copied = 0, last_eo = -1, pos = from;
+    out->len = 0;
+    while (pos <= len && regexec(re, s + pos, REPLACE_NSUB, m, pos > 0 ? REG_NOTBOL : 0) == 0) {
+        int so = pos + m[0].rm_so, eo = pos + m[0].rm_eo;
+        // 直前の一致のすぐ後ろの空の一致は置き換えない (sed と同じ)
+        if (eo > so || so != last_eo) {
+            abAppend(out, s + copied, so - copied);
+            editorExpandReplacement(out, s + pos, m, rep);
+            copied = eo;
+            count++;
+            if (!all) break;
+        }
+        if (eo > so) {
+            pos = last_eo = eo;
+        } else {
+            // 空の一致は1文字進めてから次を探す
+            if (so >= len) break;
+            pos = so + 1;
+            while (pos < len && ((unsigned char)s[pos] & 0xC0) == 0x80) pos++;
+        }
+    }
+    if (count) abAppend(out, s + copied, len - copied);
+    return count;
+}
+
+// 行の中身を '\0' 終端して buf に写す (regexec 用)
+const char *editorRowCString(erow *row, struct abuf *buf) {
+    const char *a, *b;
+    int alen, blen;
+    editorRowSpans(row, &a, &alen, &b, &blen);
+    buf->len = 0;
+    if (alen) abAppend(buf, a, alen);
+    if (blen) abAppend(buf, b, blen);
+    abAppend(buf, "", 1);
+    return buf->b;
+}
+
+// 行の中身を s[0..len) で丸ごと置き換える (ギャップは行末に置く)
+void editorRowSetContent(erow *row, const char *s, int len) {
+    editorArenaFree(row->chars, row->size);
+    size_t size = len + len / 2 + 16;
+    row->chars = editorArenaAlloc(&size);
+    row->size = size;
+    if (len) memcpy(row->chars, s, len);
+    row->len = len;
+    row->gap = len;
+    row->plain = editorIsPlain(s, len);
+}
+
+struct replacejob {
+    const char *pattern;
+    const char *rep;
+    rownum from, to;    // 行 [from, to) を受け持つ
+    long long count;    // 置き換えた数
+    struct abuf journal;    // この区間の置き換えの記録 (後で行の順に記録へ足す)
+    int journal_lost;       // 記録が大きくなりすぎて溜めきれなかったら1
+};
+
+void editorReplaceSlice(void *arg) {
+    struct replacejob *job = arg;
+    regex_t re;
+    // regexec は regex_t ごとに排他するので、スレッドごとにコンパイルし直す
+    if (regcomp(&re, job->pattern, REG_EXTENDED) != 0) return;
+    struct abuf line = ABUF_INIT, out = ABUF_INIT;
+    lsnode *leaf = NULL;
+    rownum start = 0;
+    for (rownum at = job->from; at < job->to; at++) {
+        if (!leaf || at >= start + leaf->n) leaf = lsLeafFind(at, &start);
+        erow tmp;
+        rowdesc *slot = &leaf->u.rows[at - start];
+        erow *row = editorRowDecode(*slot, &tmp);
+        const char *s = editorRowCString(row, &line);
+        int n = editorSubstitute(&re, s, row->len, 0, job->rep, 1, &out);
+        if (n) {
+            if (!E.journal_mute && !job->journal_lost &&
+                (size_t)job->journal.len + sizeof(struct jrecord) + row->len + out.len > JOURNAL_JOB_MAX) {
+                job->journal_lost = 1;
+                abFree(&job->journal);
+                job->journal = (struct abuf)ABUF_INIT;
+            }
+            if (!E.journal_mute && !job->journal_lost) {
+                struct jrecord h;
+                memset(&h, 0, sizeof(h));
+                h.type = JR_SPLICE;
+                h.row = at;
+                h.oldlen = row->len;
+                h.newlen = out.len;
+                editorJournalAppendTo(&job->journal, &h, s, out.b);
+            }
+            editorRowSetContent(row, out.b, out.len);
+            if (row == &tmp) *slot = editorRowEncode(&tmp);
+            job->count += n;
+        }
+    }
+    regfree(&re);
+    abFree(&line);
+    abFree(&out);
+}
+
+// at行目の from バイト目以降と、それより後ろの全行の一致を置き換える。置き換えた数を返す
+long long editorReplaceRest(regex_t *re, const char *pattern, const char *rep, rownum at, int from) {
+    struct abuf line = ABUF_INIT, out = ABUF_INIT;
+    erow *row = editorRowAt(at);
+    const char *s = editorRowCString(row, &line);
+    long long count = editorSubstitute(re, s, row->len, from, rep, 1, &out);
+    if (count) {
+        editorJournalSplice(at, 0, s, row->len, out.b, out.len);
+        editorRowSetContent(row, out.b, out.len);
+    }
+    abFree(&line);
+    abFree(&out);
+
+    // 残りの行は木の形を変えずに中身だけ差し替えるので、区間ごとに並列にできる
+    rownum total = E.numrows - (at + 1);
+    int n = total >= REPLACE_PAR_ROWS ? E.ncpu : 1;
+    if (n > PAR_MAX_THREADS) n = PAR_MAX_THREADS;
+    struct replacejob jobs[PAR_MAX_THREADS];
+    for (int i = 0; i < n; i++) {
+        jobs[i].pattern = pattern;
+        jobs[i].rep = rep;
+        jobs[i].from = at + 1 + total * i / n;
+        jobs[i].to = at + 1 + total * (i + 1) / n;
+        jobs[i].count = 0;
+        jobs[i].journal = (struct abuf)ABUF_INIT;
+        jobs[i].journal_lost = 0;
+    }
+    editorRunParallel(editorReplaceSlice, jobs, sizeof(jobs[0]), n);
+    int lost = 0;
+    for (int i = 0; i < n; i++) lost |= jobs[i].journal_lost;
+    if (lost && !E.journal_mute) editorJournalGiveUp();
+    // ワーカーが終わった順ではなく行の順に記録する (たどり直したときに同じ結果になるように)
+    for (int i = 0; i < n; i++) {
+        count += jobs[i].count;
+        editorJournalPutBatch(jobs[i].journal.b, jobs[i].journal.len);
+        abFree(&jobs[i].journal);
+    }
+    if (count) E.dirty++;
+    E.marks_line = -1;
+    editorFieldsReset();
+    return count;
+}
+
+void editorReplace() {
+    char *pattern = editorPrompt("Replace (regex): %s", NULL);
+    if (!pattern) return;
+    regex_t re;
+    if (regcomp(&re, pattern, REG_EXTENDED) != 0) {
+        free(pattern);
+        return;
+    }
+    // 空の置換文字列 (一致の削除) も受け付ける
+    char *rep = editorPrompt("Replace with: %s", NULL);
+    if (!rep && E.prompt_enter) rep = strdup("");
+    if (!rep) {
+        regfree(&re);
+        free(pattern);
+        return;
+    }
+
+    // 先頭から順に一致を見せて y/n で確かめる。a なら残りをまとめて置き換える
+    struct abuf line = ABUF_INIT, out = ABUF_INIT;
+    rownum at = 0;
+    int from = 0;
+    E.in_prompt = 1;
+    while (at < E.numrows) {
+        erow tmp;
+        erow *row = editorRowGet(at, &tmp);
+        const char *s = editorRowCString(row, &line);
+        regmatch_t m;
+        if (from > row->len || regexec(&re, s + from, 1, &m, from > 0 ? REG_NOTBOL : 0) != 0) {
+            at++;
+            from = 0;
+            continue;
+        }
+        int so = from + m.rm_so, eo = from + m.rm_eo;
+        E.cy = at;
+        E.cx = so;
+        E.prompt_row = at;
+        E.prompt_col = so;
+        snprintf(E.prompt_info, sizeof(E.prompt_info), "  %lld: ", E.rowbase + at + 1);
+        editorDrawPrompt("Replace? (y/n/a/q)");
+
+        int c = editorReadKey();
+        row = editorRowGet(at, &tmp);  // 受信で行の位置が変わっているかもしれない
+        if (c == 'y') {
+            row = editorRowAt(at);
+            int oldlen = row->len;
+            from = eo;
+            if (editorSubstitute(&re, s, oldlen, so, rep, 0, &out)) {
+                editorMarksInvalidate(row, so);
+                editorFieldsInvalidate(at);
+                editorJournalSplice(at, 0, s, oldlen, out.b, out.len);
+                editorRowSetContent(row, out.b, out.len);
+                E.dirty++;
+                from += out.len - oldlen;
+            }
+        } else if (c == 'n') {
+            from = eo;
+        } else if (c == 'a') {
+            editorReplaceRest(&re, pattern, rep, at, so);
+            break;
+        } else if (c == 'q' || c == '\x1b') {
+            break;
+        } else {
+            continue;
+        }
+        if (eo == so) {
+            // 空の一致は1文字進める
+            row = editorRowGet(at, &tmp);
+            from++;
+            while (from < row->len && ((unsigned char)editorRowByte(row, from) & 0xC0) == 0x80) from++;
+        }
+    }
+    E.in_prompt = 0;
+    E.prompt_row = -1;
+    E.prompt_info[0] = '\0';
+    erow tmp;
+    erow *cur = editorRowGet(E.cy, &tmp);
+    if (cur && E.cx > cur->len) E.cx = cur->len;
+    abFree(&line);
+    abFree(&out);
+    regfree(&re);
+    free(pattern);
+    free(rep);
+}
+
+// --- 絞り込み ---
+// Ctrl+T で文字列を含む行だけを上下キーで渡り歩く。行ごとの一致は512行分の枠に分けた
+// ビットマップに持ち、枠ごとの行数と一致数をそれぞれFenwick木に入れて、k 番目までの一致の数
+// (rank) と k 番目の一致行 (select) を O(log n) で引く。枠は3/4まで詰めて作るので、行の挿入・
+// 削除はその枠の中のビットをずらし、2つの木の O(log n) 個の節を直すだけで済む。
+// 枠があふれたら2つに分け、行が減って枠がまばらになったら詰め直す (どちらもまれ)。
+// ビットマップは枠の区間ごとに裏のスレッドで並列に作る
+
+#define FILTER_BLOCK 8                      // 枠の語数
+#define FILTER_ROWS (FILTER_BLOCK * 64)     // 枠に入る行数
+#define FILTER_FILL (FILTER_ROWS / 4 * 3)   // 作るときと詰め直すときに枠に入れる行数 (64の倍数)
+
+struct rowfilter;
+
+struct filterslice {
+    struct rowfilter *f;
+    size_t from, to;        // 枠 [from, to) を受け持つ
+};
+
+struct rowfilter {
+    char *needle;
+    int nlen;
+    uint64_t *bits;     // 枠 b の先頭から fill[b] 個のビットが、続く行の一致を表す (残りは0)
+    int *fill;          // 枠ごとの行数
+    size_t nblocks;     // 確保した枠の数
+    size_t used;        // 使っている枠の数 (これより後ろの枠は空)
+    rownum *fen;        // 枠ごとの一致数のFenwick木 (1始まり)
+    rownum *fenrows;    // 枠ごとの行数のFenwick木 (1始まり)
+    rownum nrows;       // ビットのある行数
+    int jump;           // できあがったらカーソル以降の最初の一致へ移る
+    // 作成中のスレッド
+    int building;
+    int nslices, done;
+    pthread_mutex_t lock;
+    struct filterslice slice[PAR_MAX_THREADS];
+    pthread_t th[PAR_MAX_THREADS];
+    int started[PAR_MAX_THREADS];
+};
+
+int editorPopcount64(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1) n++;
+    return n;
+#endif
+}
+
+int editorFilterMatch(struct rowfilter *f, erow *row) {
+    return editorRowSearch(row, f->needle, f->nlen, 0, 1) >= 0;
+}
+
+// 枠 b の先頭 n 行の一致数
+rownum editorFilterBlockCount(struct rowfilter *f, size_t b, int n) {
+    uint64_t *w = f->bits + b * FILTER_BLOCK;
+    rownum r = 0;
+    for (; n >= 64; n -= 64) r += editorPopcount64(*w++);
+    if (n) r += editorPopcount64(*w & ((UINT64_C(1) << n) - 1));
+    return r;
+}
+
+// 枠を分けたり詰め直したりしたときに、2つの木を全部作り直す (O(n / 512))
+void editorFilterRecount(struct rowfilter *f) {
+    size_t nb = f->nblocks;
+    f->fen[0] = f->fenrows[0] = 0;
+    for (size_t b = 1; b <= nb; b++) {
+        f->fen[b] = editorFilterBlockCount(f, b - 1, FILTER_ROWS);
+        f->fenrows[b] = f->fill[b - 1];
+    }
+    for (size_t b = 1; b <= nb; b++) {
+        size_t up = b + (b & -b);
+        if (up > nb) continue;
+        f->fen[up] += f->fen[b];
+        f->fenrows[up] += f->fenrows[b];
+    }
+}
+
+// 木 t の枠 b に d を足す
+void editorFilterTreeAdd(struct rowfilter *f, rownum *t, size_t b, rownum d) {
+    for (size_t i = b + 1; i <= f->nblocks; i += i & -i) t[i] += d;
+}
+
+// 木 t の枠 [0, b) の合計
+rownum editorFilterTreeSum(rownum *t, size_t b) {
+    rownum r = 0;
+    for (size_t i = b; i > 0; i -= i & -i) r += t[i];
+    return r;
+}
+
+// 木 t を上から降りて、合計が v 以下で収まる枠の数を返す。*rest には v の残りを入れる
+size_t editorFilterTreeFind(struct rowfilter *f, rownum *t, rownum v, rownum *rest) {
+    size_t lo = 0, step = 1;
+    while (step * 2 <= f->nblocks) step *= 2;
+    for (; step; step /= 2) {
+        if (lo + step <= f->nblocks && t[lo + step] <= v) {
+            lo += step;
+            v -= t[lo];
+        }
+    }
+    *rest = v;
+    return lo;
+}
+
+// at行目 (nrows 未満) のある枠を返し、枠の中の位置を *slot に入れる
+size_t editorFilterLocate(struct rowfilter *f, rownum at, int *slot) {
+    rownum rest;
+    size_t b = editorFilterTreeFind(f, f->fenrows, at, &rest);
+    *slot = (int)rest;
+    return b;
+}
+
+// 枠を need 個まで持てるよう広げる (増えた枠は空)
+void editorFilterReserve(struct rowfilter *f, size_t need) {
+    if (need <= f->nblocks) return;
+    size_t n = f->nblocks ? f->nblocks : 1;
+    while (n < need) n *= 2;
+    f->bits = realloc(f->bits, n * FILTER_BLOCK * sizeof(uint64_t));
+    f->fill = realloc(f->fill, n * sizeof(int));
+    f->fen = realloc(f->fen, (n + 1) * sizeof(rownum));
+    f->fenrows = realloc(f->fenrows, (n + 1) * sizeof(rownum));
+    if (!f->bits || !f->fill || !f->fen || !f->fenrows) die("realloc");
+    memset(f->bits + f->nblocks * FILTER_BLOCK, 0, (n - f->nblocks) * FILTER_BLOCK * sizeof(uint64_t));
+    memset(f->fill + f->nblocks, 0, (n - f->nblocks) * sizeof(int));
+    f->nblocks = n;
+    // 木の形は枠の数で決まるので組み直す
+    editorFilterRecount(f);
+}
+
+// いっぱいの枠 b を半分ずつの2つに分ける (後ろの枠は1つずつずれる)
+void editorFilterSplit(struct rowfilter *f, size_t b) {
+    editorFilterReserve(f, f->used + 1);
+    size_t half = FILTER_BLOCK / 2;
+    uint64_t *src = f->bits + b * FILTER_BLOCK, *dst = src + FILTER_BLOCK;
+    memmove(dst + FILTER_BLOCK, dst, (f->used - b - 1) * FILTER_BLOCK * sizeof(uint64_t));
+    memmove(f->fill + b + 2, f->fill + b + 1, (f->used - b - 1) * sizeof(int));
+    memcpy(dst, src + half, half * sizeof(uint64_t));
+    memset(dst + half, 0, half * sizeof(uint64_t));
+    memset(src + half, 0, half * sizeof(uint64_t));
+    f->fill[b] = f->fill[b + 1] = FILTER_ROWS / 2;
+    f->used++;
+    editorFilterRecount(f);
+}
+
+// 詰め直し先 dst (FILTER_FILL 行ずつの枠) の p 行目から、x の下位 n ビットを置く
+// (x の n ビットより上は0)
+void editorFilterPutBits(uint64_t *dst, rownum p, uint64_t x, int n) {
+    while (n > 0) {
+        rownum s = p % FILTER_FILL;
+        size_t w = (size_t)(p / FILTER_FILL) * FILTER_BLOCK + s / 64;
+        int off = s & 63, take = 64 - off < n ? 64 - off : n;
+        dst[w] |= x << off;
+        if (take < 64) x >>= take;
+        p += take;
+        n -= take;
+    }
+}
+
+// 枠を FILTER_FILL 行ずつに詰め直す
+void editorFilterRepack(struct rowfilter *f) {
+    uint64_t *bits = calloc(f->nblocks * FILTER_BLOCK, sizeof(uint64_t));
+    if (!bits) die("calloc");
+    rownum p = 0;
+    for (size_t b = 0; b < f->used; b++) {
+        for (int s = 0; s < f->fill[b]; s += 64) {
+            int n = f->fill[b] - s < 64 ? f->fill[b] - s : 64;
+            editorFilterPutBits(bits, p, f->bits[b * FILTER_BLOCK + s / 64], n);
+            p += n;
+        }
+    }
+    free(f->bits);
+    f->bits = bits;
+    f->used = (size_t)(f->nrows + FILTER_FILL - 1) / FILTER_FILL;
+    for (size_t b = 0; b < f->nblocks; b++) {
+        rownum left = f->nrows - (rownum)b * FILTER_FILL;
+        f->fill[b] = b >= f->used ? 0 : left < FILTER_FILL ? (int)left : FILTER_FILL;
+    }
+    editorFilterRecount(f);
+}
+
+// at行より前にある一致行の数
+rownum editorFilterRank(rownum at) {
+    struct rowfilter *f = E.filter;
+    if (at >= f->nrows) return editorFilterTreeSum(f->fen, f->nblocks);
+    int s;
+    size_t b = editorFilterLocate(f, at, &s);
+    return editorFilterTreeSum(f->fen, b) + editorFilterBlockCount(f, b, s);
+}
+
+// k 番目 (0始まり) の一致行
+rownum editorFilterSelect(rownum k) {
+    struct rowfilter *f = E.filter;
+    // 木を上から降りて枠を決め、その中を1語ずつ見る
+    rownum t;
+    size_t b = editorFilterTreeFind(f, f->fen, k, &t);
+    uint64_t *w = f->bits + b * FILTER_BLOCK;
+    for (int i = 0;; i++) {
+        uint64_t x = w[i];
+        int n = editorPopcount64(x);
+        if (t < n) {
+            while (t-- > 0) x &= x - 1;
+            return editorFilterTreeSum(f->fenrows, b) + i * 64 + editorCtz64(x);
+        }
+        t -= n;
+    }
+}
+
+rownum editorFilterHits() {
+    return editorFilterRank(E.filter->nrows);
+}
+
+// at行目の一致を設定し直す
+void editorFilterSet(struct rowfilter *f, rownum at, int match) {
+    int s;
+    size_t b = editorFilterLocate(f, at, &s);
+    uint64_t *w = &f->bits[b * FILTER_BLOCK + s / 64], bit = UINT64_C(1) << (s & 63);
+    if (!!(*w & bit) == match) return;
+    *w ^= bit;
+    editorFilterTreeAdd(f, f->fen, b, match ? 1 : -1);
+}
+
+// at行目 (nrows 以下) に一致が match の行を入れる
+void editorFilterPut(struct rowfilter *f, rownum at, int match) {
+    size_t b;
+    int s;
+    if (at == f->nrows) {
+        // 末尾には最後の枠がいっぱいなら新しい枠を足す
+        if (f->used == 0 || f->fill[f->used - 1] == FILTER_ROWS) {
+            editorFilterReserve(f, f->used + 1);
+            f->used++;
+        }
+        b = f->used - 1;
+        s = f->fill[b];
+    } else {
+        b = editorFilterLocate(f, at, &s);
+        if (f->fill[b] == FILTER_ROWS) {
+            editorFilterSplit(f, b);
+            if (s >= FILTER_ROWS / 2) {
+                b++;
+                s -= FILTER_ROWS / 2;
+            }
+        }
+        // 枠の中で s 以降のビットを1つ後ろへずらす
+        uint64_t *w = f->bits + b * FILTER_BLOCK;
+        int first = s / 64;
+        for (int i = f->fill[b] / 64; i > first; i--) w[i] = w[i] << 1 | w[i - 1] >> 63;
+        uint64_t low = (UINT64_C(1) << (s & 63)) - 1, x = w[first];
+        w[first] = (x & low) | (x & ~low) << 1;
+    }
+    if (match) f->bits[b * FILTER_BLOCK + s / 64] |= UINT64_C(1) << (s & 63);
+    f->fill[b]++;
+    f->nrows++;
+    editorFilterTreeAdd(f, f->fenrows, b, 1);
+    if (match) editorFilterTreeAdd(f, f->fen, b, 1);
+}
+
+// at行目に行が挿入された
+void editorFilterInsert(rownum at) {
+    struct rowfilter *f = E.filter;
+    if (!f || f->building || at > f->nrows) return;
+    erow tmp;
+    editorFilterPut(f, at, editorFilterMatch(f, editorRowGet(at, &tmp)));
+}
+
+// at行目が削除された
+void editorFilterDelete(rownum at) {
+    struct rowfilter *f = E.filter;
+    if (!f || f->building || at >= f->nrows) return;
+    int s;
+    size_t b = editorFilterLocate(f, at, &s);
+    // 枠の中で s より後ろのビットを1つ前へずらす
+    uint64_t *w = f->bits + b * FILTER_BLOCK;
+    int first = s / 64, last = (f->fill[b] - 1) / 64;
+    int match = (int)(w[first] >> (s & 63) & 1);
+    uint64_t low = (UINT64_C(1) << (s & 63)) - 1, x = w[first];
+    w[first] = (x & low) | ((x >> 1) & ~low);
+    for (int i = first; i <= last; i++) {
+        if (i > first) w[i] >>= 1;
+        if (i + 1 < FILTER_BLOCK) w[i] |= w[i + 1] << 63;
+    }
+    f->fill[b]--;
+    f->nrows--;
+    editorFilterTreeAdd(f, f->fenrows, b, -1);
+    if (match) editorFilterTreeAdd(f, f->fen, b, -1);
+    // 先頭からの送出や大きな削除で枠がまばらになったら詰め直す
+    if (f->used > 1 && (size_t)f->nrows < f->used * (FILTER_ROWS / 4)) editorFilterRepack(f);
+}
+
+// 受信などで末尾に増えた行を調べる
+void editorFilterExtend() {
+    struct rowfilter *f = E.filter;
+    if (!f || f->building) return;
+    while (f->nrows < E.numrows) {
+        erow tmp;
+        editorFilterPut(f, f->nrows, editorFilterMatch(f, editorRowGet(f->nrows, &tmp)));
+    }
+}
+
+// 編集されたかもしれない at行目を調べ直す
+void editorFilterUpdate(rownum at) {
+    struct rowfilter *f = E.filter;
+    if (!f || f->building || at < 0 || at >= f->nrows) return;
+    erow tmp;
+    editorFilterSet(f, at, editorFilterMatch(f, editorRowGet(at, &tmp)));
+}
+
+// 枠 [from, to) のビットを作る。裏のスレッドからも呼ぶので行は葉から直接読む
+void editorFilterBuild(struct rowfilter *f, size_t from, size_t to) {
+    lsnode *leaf = NULL;
+    rownum start = 0;
+    for (size_t b = from; b < to; b++) {
+        uint64_t *w = f->bits + b * FILTER_BLOCK;
+        for (int s = 0; s < f->fill[b]; s++) {
+            rownum at = (rownum)b * FILTER_FILL + s;
+            if (!leaf || at >= start + leaf->n) leaf = lsLeafFind(at, &start);
+            erow tmp;
+            if (editorFilterMatch(f, editorRowDecode(leaf->u.rows[at - start], &tmp)))
+                w[s / 64] |= UINT64_C(1) << (s & 63);
+        }
+    }
+}
+
+void *editorFilterWorker(void *arg) {
+    struct filterslice *sl = arg;
+    struct rowfilter *f = sl->f;
+    editorFilterBuild(f, sl->from, sl->to);
+    pthread_mutex_lock(&f->lock);
+    f->done++;
+    pthread_mutex_unlock(&f->lock);
+    if (write(E.notify_pipe[1], "", 1) == -1) {
+        // パイプが詰まっていても done は数えてある
+    }
+    return NULL;
+}
+
+void editorFilterFree() {
+    struct rowfilter *f = E.filter;
+    if (!f) return;
+    for (int i = 0; f->building && i < f->nslices; i++)
+        if (f->started[i]) pthread_join(f->th[i], NULL);
+    pthread_mutex_destroy(&f->lock);
+    free(f->needle);
+    free(f->bits);
+    free(f->fill);
+    free(f->fen);
+    free(f->fenrows);
+    free(f);
+    E.filter = NULL;
+}
+
+// needle を含む行のビットマップを作り始める (行数が少なければその場で作る)
+void editorFilterStart(const char *needle, int nlen) {
+    editorFilterFree();
+    struct rowfilter *f = calloc(1, sizeof(struct rowfilter));
+    if (!f) die("calloc");
+    pthread_mutex_init(&f->lock, NULL);
+    f->needle = malloc(nlen);
+    if (!f->needle) die("malloc");
+    memcpy(f->needle, needle, nlen);
+    f->nlen = nlen;
+    f->nrows = E.numrows;
+    f->used = (size_t)(f->nrows + FILTER_FILL - 1) / FILTER_FILL;
+    editorFilterReserve(f, f->used + 1);
+    for (size_t b = 0; b < f->used; b++) {
+        rownum left = f->nrows - (rownum)b * FILTER_FILL;
+        f->fill[b] = left < FILTER_FILL ? (int)left : FILTER_FILL;
+    }
+    E.filter = f;
+
+    int bg = f->nrows >= SEARCH_BG_ROWS && editorNotifyPipe() != -1;
+    int n = bg ? E.ncpu : 1;
+    if (n > PAR_MAX_THREADS) n = PAR_MAX_THREADS;
+    f->nslices = n;
+    for (int i = 0; i < n; i++) {
+        f->slice[i].f = f;
+        f->slice[i].from = f->used * i / n;
+        f->slice[i].to = f->used * (i + 1) / n;
+    }
+    if (!bg) {
+        editorFilterBuild(f, 0, f->used);
+        editorFilterRecount(f);
+        return;
+    }
+    f->building = 1;
+    for (int i = 0; i < n; i++) {
+        f->started[i] = pthread_create(&f->th[i], NULL, editorFilterWorker, &f->slice[i]) == 0;
+        if (!f->started[i]) editorFilterWorker(&f->slice[i]);
+    }
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->len) at = row->len;
-    row->chars = realloc(row->chars, row->len + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->len - at + 1);
-    row->len++;
-    row->chars[at] = c;
-    E.cx++;
+// 裏で作っているビットマップが全部できていれば1
+int editorFilterReady() {
+    struct rowfilter *f = E.filter;
+    pthread_mutex_lock(&f->lock);
+    int ready = f->done == f->nslices;
+    pthread_mutex_unlock(&f->lock);
+    return ready;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->len + len + 1);
-    memcpy(&row->chars[row->len], s, len);
-    row->len += len;
-    row->chars[row->len] = '\0';
+// カーソル行以降 (なければそれより前) の最初の一致へ移る
+void editorFilterFirst() {
+    rownum k = editorFilterRank(E.cy);
+    rownum hits = editorFilterHits();
+    if (hits > 0) {
+        E.cy = editorFilterSelect(k < hits ? k : hits - 1);
+        E.cx = 0;
+    }
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->len) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->len - at);
-    row->len--;
+// ビットマップの作成を待って仕上げる
+void editorFilterFinish() {
+    struct rowfilter *f = E.filter;
+    if (!f || !f->building) return;
+    for (int i = 0; i < f->nslices; i++)
+        if (f->started[i]) pthread_join(f->th[i], NULL);
+    f->building = 0;
+    editorDrainNotify();
+    editorFilterRecount(f);
+    if (f->jump) editorFilterFirst();
 }
 
-// --- エディタ操作 ---
+// 置換などで行の中身がまとめて変わったら作り直す
+void editorFilterRefresh() {
+    struct rowfilter *f = E.filter;
+    if (!f) return;
+    editorFilterFinish();
+    char *needle = f->needle;
+    f->needle = NULL;
+    editorFilterStart(needle, f->nlen);
+    free(needle);
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+// 絞り込み中の上下移動。一致行の間を飛ぶ
+void editorFilterMove(int key) {
+    rownum hits = editorFilterHits();
+    rownum cy = E.cy < E.filter->nrows ? E.cy : E.filter->nrows;
+    if (key == ARROW_DOWN) {
+        rownum k = editorFilterRank(cy + 1);
+        if (k < hits) E.cy = editorFilterSelect(k);
+    } else {
+        rownum k = editorFilterRank(cy);
+        if (k > 0) E.cy = editorFilterSelect(k - 1);
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    erow tmp;
+    erow *row = editorRowGet(E.cy, &tmp);
+    if (row && E.cx > row->len) E.cx = row->len;
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
+void editorFilter() {
+    char *needle = editorPrompt("Filter: %s", NULL);
+    if (!needle) {
+        // 空なら絞り込みをやめる
+        if (E.prompt_enter) editorFilterFree();
+        return;
+    }
+    editorFilterStart(needle, strlen(needle));
+    free(needle);
+    if (E.filter->building) {
+        E.filter->jump = 1;
+        if (E.script) editorFilterFinish();
     } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->len - E.cx);
-        row = &E.row[E.cy];
-        row->len = E.cx;
-        row->chars[row->len] = '\0';
+        editorFilterFirst();
     }
-    E.cy++;
-    E.cx = 0;
 }
 
-void editorBackspace() {
-    erow *row = &E.row[E.cy];
-    if (E.cx == 0 && E.cy == 0) return;
-    if (E.cx > 0) {
-        int delete_len = 0;
-        int pos = E.cx;
-        do {
-            pos--;
-            delete_len++;
-        } while (pos > 0 && is_utf8_continuation(row->chars[pos]));
-        for(int i=0; i<delete_len; i++) editorRowDelChar(row, pos);
-        E.cx = pos;
-    } else {
-        erow *prev_row = &E.row[E.cy - 1];
-        E.cx = prev_row->len;
-        editorRowAppendString(prev_row, row->chars, row->len);
-        editorDelRow(E.cy);
-        E.cy--;
+// 裏で検索や絞り込みをしている間は端末と通知パイプの両方を待ち、
+// 先に区切りの通知が来たら1を返す
+int editorWaitNotify() {
+    while (!E.script && E.inpos >= E.inlen && !E.winch) {
+        if (E.filter && E.filter->building) {
+            if (editorFilterReady()) {
+                // できあがったらここで仕上げる (プロンプトの中で待っていても次は端末を読む)。
+                // プロンプトの中ではカーソルはそのコマンドに任せ、最初の一致へは移らない
+                if (E.in_prompt) E.filter->jump = 0;
+                editorFilterFinish();
+                return 1;
+            }
+        } else if (!E.search || E.search->notify == -1) {
+            return 0;
+        }
+        struct pollfd pfd[2] = {{E.tty_fd, POLLIN, 0}, {E.notify_pipe[0], POLLIN, 0}};
+        // 長い検索の間も編集の記録は間を空けてディスクへ届ける
+        int r = poll(pfd, 2, editorJournalGroupSync());
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+        if (r == 0) continue;
+        if (pfd[0].revents) return 0;
+        if (pfd[1].revents) {
+            editorDrainNotify();
+            return 1;
+        }
     }
+    return 0;
 }
 
-// カーソル直前の単語を削除 (Ctrl+W)
-void editorDeleteWord() {
-    erow *row = &E.row[E.cy];
-    if (E.cx == 0) return;
+// --- 欄 (CSV/TSV) ---
+// --columns では行を区切り文字で欄に分けて扱う。Tab / Shift+Tab で次・前の欄へ、
+// Ctrl+O で番号か見出しの名前を入れてその欄へ飛び、上下の移動は同じ欄に留まる。
+// 状態表示には今の欄の番号と、見出し行 (先頭行) のその欄の名前を添える。
+// 欄の開始位置は行を初めて見たときに区切り文字と引用符をSIMDでまとめて探して表にし、
+// FIELD_CACHE 行分を覚えておくので、その後の欄の移動はO(1)。
+// 引用符 (") の中の区切り文字は欄を分けない。行をまたぐ引用は扱わない
 
-    // スペースをスキップ
-    int pos = E.cx;
-    while (pos > 0 && isspace((unsigned char)row->chars[pos - 1])) {
-        pos--;
+// 区切り文字を決める。-t があればそれ、なければ見出し行に一番多く現れるもの
+void editorColumnsDelim() {
+    if (E.col_delim) return;
+    if (E.key_delim) {
+        E.col_delim = E.key_delim;
+        return;
     }
-    // 単語の先頭を探す
-    while (pos > 0 && !isspace((unsigned char)row->chars[pos - 1])) {
-        // UTF-8の後退処理（本当はもっと厳密にやるべきだが、簡易的にスペース区切りで動かす）
-        pos--;
-        while (pos > 0 && is_utf8_continuation(row->chars[pos])) pos--;
+    if (E.numrows == 0) return;
+    static const char cand[] = ",\t;|";
+    const char *a, *b;
+    int alen, blen, most = 0;
+    erow tmp;
+    editorRowSpans(editorRowGet(0, &tmp), &a, &alen, &b, &blen);
+    E.col_delim = ',';
+    for (int i = 0; cand[i]; i++) {
+        int n = 0;
+        for (int j = 0; j < alen; j++) n += a[j] == cand[i];
+        for (int j = 0; j < blen; j++) n += b[j] == cand[i];
+        if (n > most) {
+            most = n;
+            E.col_delim = cand[i];
+        }
     }
+}
 
-    // posまで削除
-    while (E.cx > pos) {
-        editorBackspace();
+// 欄の開始位置を1つ足す
+void editorFieldPush(struct fieldcache *fc, int at) {
+    if (fc->n == fc->cap) {
+        fc->cap = fc->cap ? fc->cap * 2 : 16;
+        fc->start = realloc(fc->start, sizeof(int) * fc->cap);
+        if (!fc->start) die("realloc");
     }
+    fc->start[fc->n++] = at;
 }
 
-// 行頭からカーソルまで削除 (Ctrl+U)
-void editorDeleteToStart() {
-    while (E.cx > 0) {
-        editorBackspace();
-    }
+// p[i] は区切り文字か引用符。引用符の外の区切り文字なら次の欄が始まる
+void editorFieldMark(struct fieldcache *fc, const char *p, int i, int base, int *inq) {
+    if (p[i] == '"') *inq = !*inq;
+    else if (!*inq) editorFieldPush(fc, base + i + 1);
 }
 
-// カーソルから行末まで削除 (Ctrl+K)
-void editorDeleteToEnd() {
-    erow *row = &E.row[E.cy];
-    int remaining = row->len - E.cx;
-    for (int i = 0; i < remaining; i++) {
-        editorRowDelChar(row, E.cx);
+// 行の base バイト目からの p[0..len) を調べる。*inq は引用符の中にいるか
+void editorFieldSpan(struct fieldcache *fc, const char *p, int len, int base, int *inq) {
+    const char d = E.col_delim;
+    int i = 0;
+#if defined(__AVX2__)
+    const __m256i vd = _mm256_set1_epi8(d), vq = _mm256_set1_epi8('"');
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, vd), _mm256_cmpeq_epi8(v, vq)));
+        for (; mask; mask &= mask - 1) editorFieldMark(fc, p, i + editorCtz64(mask), base, inq);
     }
+#elif defined(__SSE2__)
+    const __m128i vd = _mm_set1_epi8(d), vq = _mm_set1_epi8('"');
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        uint64_t mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vd), _mm_cmpeq_epi8(v, vq)));
+        for (; mask; mask &= mask - 1) editorFieldMark(fc, p, i + editorCtz64(mask), base, inq);
+    }
+#endif
+    for (; i < len; i++)
+        if (p[i] == d || p[i] == '"') editorFieldMark(fc, p, i, base, inq);
 }
 
-void editorGoToLine() {
-    char *input = editorPrompt("Go to line: %s");
-    if (input) {
-        int linenum = atoi(input);
-        free(input);
-        if (linenum > 0 && linenum <= E.numrows) {
-            E.cy = linenum - 1;
-            E.cx = 0;
-        }
+// a[0..alen) b[0..blen) の行の欄の表を作り直す。start[n] は番兵 (行の長さ+1)
+void editorFieldScan(struct fieldcache *fc, const char *a, int alen, const char *b, int blen) {
+    int inq = 0;
+    fc->n = 0;
+    editorFieldPush(fc, 0);
+    editorFieldSpan(fc, a, alen, 0, &inq);
+    editorFieldSpan(fc, b, blen, alen, &inq);
+    editorFieldPush(fc, alen + blen + 1);
+    fc->n--;
+}
+
+// at行目の欄の表。覚えていなければ作る
+struct fieldcache *editorFields(rownum at) {
+    editorColumnsDelim();
+    struct fieldcache *fc = &E.fields[at % FIELD_CACHE];
+    if (fc->line == at && fc->gen == E.fields_gen) return fc;
+    const char *a, *b;
+    int alen, blen;
+    erow tmp;
+    editorRowSpans(editorRowGet(at, &tmp), &a, &alen, &b, &blen);
+    editorFieldScan(fc, a, alen, b, blen);
+    fc->line = at;
+    fc->gen = E.fields_gen;
+    return fc;
+}
+
+// at行目が書き換わったときに呼ぶ
+void editorFieldsInvalidate(rownum at) {
+    if (E.fields[at % FIELD_CACHE].line == at) E.fields[at % FIELD_CACHE].line = -1;
+    if (at == 0 && E.col_head.line == 0) E.col_head.line = -1;
+}
+
+// 行が挿入・削除されて行番号がずれたときに呼ぶ (覚えた表をまとめて捨てる)
+void editorFieldsReset() {
+    E.fields_gen++;
+}
+
+// fc の行で cx バイト目を含む欄 (直前に求めた欄ならそのまま返す)
+int editorFieldIndex(struct fieldcache *fc, int cx) {
+    int k = E.col_last;
+    if (k >= 0 && k < fc->n && fc->start[k] <= cx && cx < fc->start[k + 1]) return k;
+    int lo = 0, hi = fc->n - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (fc->start[mid] <= cx) lo = mid;
+        else hi = mid - 1;
     }
+    E.col_last = lo;
+    return lo;
 }
 
-// --- 入出力 (Pipe対応) ---
+// at行目の欄 k の中身の先頭 (引用符の内側)
+int editorFieldBegin(rownum at, struct fieldcache *fc, int k) {
+    int s = fc->start[k];
+    erow tmp;
+    if (s < fc->start[k + 1] - 1 && editorRowByte(editorRowGet(at, &tmp), s) == '"') s++;
+    return s;
+}
 
-// --- 修正版 editorOpen (v0.6) ---
-void editorOpen(char *filename) {
-    FILE *fp;
-    
-    // ★修正ポイント: ファイル名がなく、かつ標準入力が端末(TTY)の場合
-    // パイプラインの先頭 (slit | cat) または単独起動 (slit) なので、
-    // 入力を待たずに「空のドキュメント」として開始する。
-    if (!filename && isatty(STDIN_FILENO)) {
-        editorInsertRow(0, "", 0);
+// at行目の欄 k の中身の off バイト目へカーソルを置く。欄が足りなければ行末へ
+void editorFieldGo(rownum at, int k, int off) {
+    struct fieldcache *fc = editorFields(at);
+    erow tmp;
+    erow *row = editorRowGet(at, &tmp);
+    if (k >= fc->n) {
+        E.cx = row->len;
         return;
     }
+    int s = editorFieldBegin(at, fc, k), e = fc->start[k + 1] - 1;
+    E.cx = off < e - s ? s + off : e;
+    while (E.cx > s && is_utf8_continuation(editorRowByte(row, E.cx))) E.cx--;
+    E.col_last = k;
+}
 
-    if (filename) {
-        // ファイルモード
-        free(E.filename);
-        E.filename = strdup(filename);
-        fp = fopen(filename, "r");
-
-        // バイナリチェック
-        if (fp) {
-            char buf[1024];
-            size_t bytes_read = fread(buf, 1, sizeof(buf), fp);
-            for (size_t i = 0; i < bytes_read; i++) {
-                if (buf[i] == '\0') {
-                    fclose(fp);
-                    fprintf(stderr, "slit: Binary file detected. Cannot edit.\n");
-                    exit(1);
-                }
-            }
-            // チェック完了後、ファイルポインタを先頭に戻す
-            rewind(fp);
-        }
-    } else {
-        // パイプモード: 標準入力から読む
-        // (isattyチェックを抜けたということは、ここはパイプからの入力)
-        E.filename = NULL;
-        fp = stdin;
+// Tab / Shift+Tab: 次 (dir > 0)・前の欄へ。行の端では隣の行へ移る
+void editorFieldMove(int dir) {
+    if (!E.columns || E.cy >= E.numrows) return;
+    int k = editorFieldIndex(editorFields(E.cy), E.cx) + dir;
+    if (k < 0) {
+        if (E.cy == 0) return;
+        E.cy--;
+        k = editorFields(E.cy)->n - 1;
+    } else if (k >= editorFields(E.cy)->n) {
+        if (E.cy >= E.numrows - 1) return;
+        E.cy++;
+        k = 0;
     }
+    editorFieldGo(E.cy, k, 0);
+}
 
-    if (!fp) {
-        if (filename) editorInsertRow(0, "", 0); 
-        return; 
+// 見出しの欄の表と、見出し行の中身 (送り出した後は写しを使う)。なければNULL
+struct fieldcache *editorColumnHeader(const char **a, int *alen, const char **b, int *blen) {
+    struct fieldcache *fc = &E.col_head;
+    if (E.col_header) {
+        *a = E.col_header;
+        *alen = E.col_headerlen;
+        *b = NULL;
+        *blen = 0;
+    } else if (E.rowbase == 0 && E.numrows > 0) {
+        erow tmp;
+        editorRowSpans(editorRowGet(0, &tmp), a, alen, b, blen);
+    } else {
+        return NULL;
+    }
+    if (fc->line != 0 || fc->gen != E.fields_gen) {
+        editorColumnsDelim();
+        editorFieldScan(fc, *a, *alen, *b, *blen);
+        fc->line = 0;
+        fc->gen = E.fields_gen;
     }
+    return fc;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
+// 見出し行が送り出される前に写しておく (パイプモードの Ctrl+D・--window)
+void editorColumnKeepHeader() {
+    if (!E.columns || E.col_header || E.rowbase > 0 || E.numrows == 0) return;
+    const char *a, *b;
+    int alen, blen;
+    erow tmp;
+    editorRowSpans(editorRowGet(0, &tmp), &a, &alen, &b, &blen);
+    E.col_header = malloc(alen + blen + 1);
+    if (!E.col_header) die("malloc");
+    memcpy(E.col_header, a, alen);
+    if (blen) memcpy(E.col_header + alen, b, blen);
+    E.col_headerlen = alen + blen;
+    E.col_head.line = -1;
+}
 
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+// 見出しの欄 k の名前を buf に入れ、長さを返す (表示できないバイトは ? にする)
+int editorColumnName(int k, char *buf, int size) {
+    const char *a, *b;
+    int alen, blen;
+    struct fieldcache *fc = editorColumnHeader(&a, &alen, &b, &blen);
+    buf[0] = '\0';
+    if (!fc || k >= fc->n) return 0;
+    int s = fc->start[k], e = fc->start[k + 1] - 1;
+#define HDR(j) ((j) < alen ? a[(j)] : b[(j) - alen])
+    if (e - s >= 2 && HDR(s) == '"' && HDR(e - 1) == '"') {
+        s++;
+        e--;
     }
-    free(line);
-    
-    if (filename) fclose(fp);
-    
-    if (E.numrows == 0) editorInsertRow(0, "", 0);
+    int len = 0;
+    for (int j = s; j < e && len < size - 1; j++) {
+        unsigned char c = HDR(j);
+        buf[len++] = c < 0x20 || c == 0x7f ? '?' : c;
+    }
+#undef HDR
+    // 切り詰めて文字の途中で終わったら、その文字ごと落とす
+    if (len < e - s) {
+        int j = len;
+        while (j > 0 && is_utf8_continuation(buf[j - 1])) j--;
+        if (j > 0 && (unsigned char)buf[j - 1] >= 0xc0) {
+            unsigned char lead = buf[j - 1];
+            int need = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : 2;
+            if (len - (j - 1) < need) len = j - 1;
+        }
+    }
+    buf[len] = '\0';
+    return len;
 }
 
-void editorSave() {
-    FILE *fp;
-    
-    if (E.filename) {
-        // ファイルへ保存
-        fp = fopen(E.filename, "w");
-    } else {
-        // パイプモード: 標準出力へ書き出す
-        fp = stdout;
+// 名前が name の欄 (大文字小文字は区別しない。なければ name で始まる最初の欄)。なければ-1
+int editorColumnFind(const char *name) {
+    const char *a, *b;
+    int alen, blen;
+    struct fieldcache *fc = editorColumnHeader(&a, &alen, &b, &blen);
+    if (!fc) return -1;
+    char buf[256];
+    int prefix = -1;
+    for (int k = 0; k < fc->n; k++) {
+        editorColumnName(k, buf, sizeof(buf));
+        if (strcasecmp(buf, name) == 0) return k;
+        if (prefix < 0 && strncasecmp(buf, name, strlen(name)) == 0) prefix = k;
     }
+    return prefix;
+}
 
-    if (!fp) return;
-    
-    for (int i = 0; i < E.numrows; i++) {
-        fprintf(fp, "%s\n", E.row[i].chars);
+// Ctrl+O: 番号 (1始まり) か見出しの名前で欄へ飛ぶ
+void editorFieldJump() {
+    if (!E.columns || E.cy >= E.numrows) return;
+    char *input = editorPrompt("Go to field (number or name): %s", NULL);
+    if (!input) return;
+    int k = input[0] && strspn(input, "0123456789") == strlen(input) ? atoi(input) - 1
+                                                                       : editorColumnFind(input);
+    free(input);
+    if (k < 0 || k >= editorFields(E.cy)->n) {
+        snprintf(E.notice, sizeof(E.notice), "no such field");
+        return;
     }
-    
-    if (E.filename) fclose(fp);
-    // stdoutの場合は閉じない（呼び出し元が閉じる）
+    editorFieldGo(E.cy, k, 0);
+}
+
+// 状態表示に添える今の欄の番号と名前 (" #12 price")
+void editorColumnStatus(char *buf, int size) {
+    buf[0] = '\0';
+    if (!E.columns || E.cy >= E.numrows) return;
+    int k = editorFieldIndex(editorFields(E.cy), E.cx);
+    char name[32];
+    int n = snprintf(buf, size, " #%d", k + 1);
+    if (editorColumnName(k, name, sizeof(name)) > 0 && n < size) snprintf(buf + n, size - n, " %s", name);
 }
 
 // --- UI制御 ---
 
-void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+// 1文字・1行ぶん動かす
+void editorMoveCursorBy(int key) {
+    erow tmp;
+    erow *row = editorRowGet(E.cy, &tmp);
     switch (key) {
         case ARROW_LEFT:
             if (E.cx > 0) {
-                do { E.cx--; } while (E.cx > 0 && is_utf8_continuation(row->chars[E.cx]));
+                do { E.cx--; } while (!row->plain && E.cx > 0 && is_utf8_continuation(editorRowByte(row, E.cx)));
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].len;
+                E.cx = editorRowGet(E.cy, &tmp)->len;
             }
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->len) {
-                do { E.cx++; } while (E.cx < row->len && is_utf8_continuation(row->chars[E.cx]));
+                do { E.cx++; } while (!row->plain && E.cx < row->len && is_utf8_continuation(editorRowByte(row, E.cx)));
             } else if (row && E.cx == row->len && E.cy < E.numrows - 1) {
                 E.cy++;
                 E.cx = 0;
@@ -416,35 +4963,147 @@ void editorMoveCursor(int key) {
         case ARROW_UP:
             if (E.cy > 0) {
                 E.cy--;
-                if (E.cx > E.row[E.cy].len) E.cx = E.row[E.cy].len;
+                row = editorRowGet(E.cy, &tmp);
+                if (E.cx > row->len) E.cx = row->len;
             }
             break;
         case ARROW_DOWN:
             if (E.cy < E.numrows - 1) {
                 E.cy++;
-                if (E.cx > E.row[E.cy].len) E.cx = E.row[E.cy].len;
+                row = editorRowGet(E.cy, &tmp);
+                if (E.cx > row->len) E.cx = row->len;
             }
             break;
     }
 }
 
-int editorReadKey() {
-    int nread;
-    char c;
-    // ★キー入力は制御端末(tty_fd)から読む
-    while ((nread = read(E.tty_fd, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+void editorMoveCursor(int key) {
+    // 欄モードの上下は同じ欄の同じ位置へ
+    int vertical = key == ARROW_UP || key == ARROW_DOWN;
+    rownum oldcy = E.cy;
+    int field = -1, off = 0;
+    if (E.columns && vertical && E.cy < E.numrows) {
+        struct fieldcache *fc = editorFields(E.cy);
+        field = editorFieldIndex(fc, E.cx);
+        off = E.cx - editorFieldBegin(E.cy, fc, field);
+        if (off < 0) off = 0;
+    }
+    // 絞り込み中の上下は一致行の間を飛ぶ
+    if (E.filter && vertical) editorFilterMove(key);
+    else editorMoveCursorBy(key);
+    if (field >= 0 && E.cy != oldcy && E.cy < E.numrows) editorFieldGo(E.cy, field, off);
+}
+
+// 未処理の入力があるか (キューに残っているか、端末に届いているか)
+int editorInputPending() {
+    if (E.script) return E.scriptpos < E.scriptlen;
+    if (E.inpos < E.inlen) return 1;
+    struct pollfd pfd = {E.tty_fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+// キューから1バイト取り出す。空なら端末から読めるだけまとめて読む
+char editorReadByte() {
+    if (E.script) {
+        // スクリプトを読み終えたら ESC (保存して終了) を押したことにする
+        return E.scriptpos < E.scriptlen ? E.script[E.scriptpos++] : '\x1b';
+    }
+    while (E.inpos >= E.inlen) {
+        // 待つ前にここまでの編集の記録を書く。ディスクへ届けるのは間を空けてまとめて行い、
+        // それまでは打鍵が来なければ届ける時刻に起きる
+        int sync_ms = editorJournalGroupSync();
+        if (sync_ms >= 0) {
+            struct pollfd pfd = {E.tty_fd, POLLIN, 0};
+            if (poll(&pfd, 1, sync_ms) == 0) continue;
+        }
+        // 端末サイズが変わったら幅を取り直して描き直す
+        if (E.winch) {
+            editorUpdateWindowSize();
+            E.painted_valid = 0;
+            if (!E.in_prompt) editorRefreshLine();
+        }
+        if (editorSourceCheck()) editorRefreshLine();
+        if (E.save_pid > 0) {
+            // 裏で保存している間は子プロセスからの知らせも待つ
+            struct pollfd pfd[2] = {{E.tty_fd, POLLIN, 0}, {E.save_fd, POLLIN, 0}};
+            if (poll(pfd, 2, -1) == -1) {
+                if (errno == EINTR) continue;
+                die("poll");
+            }
+            if (!pfd[0].revents) {
+                if (editorSaveCheck() && !E.in_prompt && !editorInputPending()) editorRefreshLine();
+                continue;
+            }
+        }
+        if (E.stream_fd != -1 && !E.search && !(E.filter && E.filter->building)) {
+            // パイプ受信中は端末と標準入力の両方を待つ (裏のスレッドが行を読んでいる間は受け取らない)
+            struct pollfd pfd[2] = {{E.tty_fd, POLLIN, 0}, {E.stream_fd, POLLIN, 0}};
+            if (poll(pfd, 2, -1) == -1) {
+                if (errno == EINTR) continue;
+                die("poll");
+            }
+            if (!pfd[0].revents) {
+                // 行数表示を更新する (キー入力が溜まっていれば後回し)
+                if (editorIngest() && !E.in_prompt && !editorInputPending()) editorRefreshLine();
+                continue;
+            }
+        }
+        if (E.follow && !E.search && !(E.filter && E.filter->building)) {
+            // 追従中はファイルの変化の通知と一定間隔の見回りも待つ
+            struct pollfd pfd[2] = {{E.tty_fd, POLLIN, 0}, {E.follow_fd, POLLIN, 0}};
+            if (poll(pfd, E.follow_fd != -1 ? 2 : 1, FOLLOW_POLL_MS) == -1) {
+                if (errno == EINTR) continue;
+                die("poll");
+            }
+            if (!pfd[0].revents) {
+                if (editorFollow() && !E.in_prompt && !editorInputPending()) editorRefreshLine();
+                continue;
+            }
+        }
+        // ★キー入力は制御端末(tty_fd)から読む
+        int nread = read(E.tty_fd, E.inbuf, sizeof(E.inbuf));
+        if (nread > 0) {
+            E.inlen = nread;
+            E.inpos = 0;
+            break;
+        }
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
     }
+    return E.inbuf[E.inpos++];
+}
 
-    if (c == '\x1b') {
-        int bytes_waiting;
-        if (ioctl(E.tty_fd, FIONREAD, &bytes_waiting) == 0 && bytes_waiting == 0) {
-            return '\x1b';
+// ESC[200~ の後ろ、ESC[201~ までを E.paste に読み込む
+void editorReadPaste() {
+    static const char end[] = "\x1b[201~";
+    size_t endlen = sizeof(end) - 1;
+    E.pastelen = 0;
+    while (!E.script || E.scriptpos < E.scriptlen) {
+        if (E.pastelen == E.pastecap) {
+            E.pastecap = E.pastecap ? E.pastecap * 2 : 4096;
+            E.paste = realloc(E.paste, E.pastecap);
+            if (!E.paste) die("realloc");
+        }
+        char c = editorReadByte();
+        E.paste[E.pastelen++] = c;
+        if (c == '~' && E.pastelen >= endlen &&
+            memcmp(&E.paste[E.pastelen - endlen], end, endlen) == 0) {
+            E.pastelen -= endlen;
+            return;
         }
+    }
+}
+
+int editorReadKey() {
+    while (1) {
+        if (editorWaitNotify()) return NOTIFY_KEY;
+        char c = editorReadByte();
+        if (c != '\x1b') return c;
+
+        if (!editorInputPending()) return '\x1b';
 
         char seq[3];
-        if (read(E.tty_fd, &seq[0], 1) != 1) return '\x1b';
-        if (read(E.tty_fd, &seq[1], 1) != 1) return '\x1b';
+        seq[0] = editorReadByte();
+        seq[1] = editorReadByte();
 
         if (seq[0] == '[') {
             switch (seq[1]) {
@@ -452,47 +5111,90 @@ int editorReadKey() {
                 case 'B': return ARROW_DOWN;
                 case 'C': return ARROW_RIGHT;
                 case 'D': return ARROW_LEFT;
+                case 'H': return HOME_KEY;
+                case 'F': return END_KEY;
+                case 'Z': return BACKTAB_KEY;
+            }
+            if (isdigit((unsigned char)seq[1])) {
+                // ESC[<数字>~ 形式 (貼り付けの開始やHome/End)
+                int num = seq[1] - '0';
+                while ((seq[2] = editorReadByte()) != '~') {
+                    if (!isdigit((unsigned char)seq[2])) return '\x1b';
+                    num = num * 10 + (seq[2] - '0');
+                }
+                if (num == 200) {
+                    editorReadPaste();
+                    return PASTE_KEY;
+                }
+                if (num == 1 || num == 7) return HOME_KEY;
+                if (num == 4 || num == 8) return END_KEY;
+                continue; // 未対応のキーは読み捨てる
             }
         }
         return '\x1b';
     }
-    return c;
+}
+
+// プロンプト msg を描く。E.prompt_info と E.prompt_row が設定されていれば後ろに添える
+void editorDrawPrompt(const char *msg) {
+    int msglen = strlen(msg);
+    int cursor = editorStrWidth(msg, msglen);
+    E.frame.len = 0;
+    abAppend(&E.frame, msg, msglen);
+    int infolen = strlen(E.prompt_info);
+    int room = E.screencols - cursor - editorStrWidth(E.prompt_info, infolen) - 1;
+    if (room > 0) {
+        abAppend(&E.frame, E.prompt_info, infolen);
+        if (E.prompt_row >= 0 && E.prompt_row < E.numrows) {
+            // 注目する位置が左から1/4あたりに来るよう切り出す
+            int saved = E.coloff;
+            int rx = editorCxToRx(E.prompt_row, E.prompt_col);
+            E.coloff = rx > room / 4 ? rx - room / 4 : 0;
+            editorDrawRowSlice(&E.frame, E.prompt_row, room);
+            E.coloff = saved;
+        }
+    }
+    editorPaint(cursor);
 }
 
 // プロンプトを表示して入力を受け取る汎用関数
 // prompt: "Go to line: %s" のようなフォーマット文字列
-// callback: 入力変更時に呼ばれる関数（今回はNULLでOK）
-char *editorPrompt(char *prompt) {
+// callback: キーを受け取るたびに (入力中の文字列, キー) で呼ばれる関数 (NULLなら呼ばない)
+// 空のまま Enter を押したときもNULLを返す (ESCと区別するには E.prompt_enter を見る)
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
     size_t buflen = 0;
     buf[0] = '\0';
 
+    E.in_prompt = 1;
+    E.prompt_enter = 0;
     while (1) {
         // ステータスライン（プロンプト）を描画
         // slitは1行エディタなので、現在の行を一時的にプロンプトで上書きする形になる
         // 本来のエディタ内容は見えなくなるが、キャンセルすれば戻る
-        struct abuf ab = ABUF_INIT;
-        abAppend(&ab, "\r\x1b[K", 5); // 行消去
-
         char msg[128];
         snprintf(msg, sizeof(msg), prompt, buf);
-        abAppend(&ab, msg, strlen(msg));
-
-        tty_write(ab.b, ab.len);
-        abFree(&ab);
+        editorDrawPrompt(msg);
 
         int c = editorReadKey();
         if (c == 127 || c == CTRL_KEY('h') || c == '\b') {
-            if (buflen != 0) buf[--buflen] = '\0';
+            // UTF-8の続きのバイトもまとめて消す
+            while (buflen != 0 && ((unsigned char)buf[--buflen] & 0xC0) == 0x80);
+            buf[buflen] = '\0';
         } else if (c == '\x1b') {
+            if (callback) callback(buf, c);
+            E.in_prompt = 0;
             free(buf);
             return NULL;
         } else if (c == 13) {
+            if (callback) callback(buf, c);
+            E.in_prompt = 0;
+            E.prompt_enter = 1;
             if (buflen != 0) return buf;
             free(buf);
             return NULL;
-        } else if (!iscntrl(c) && c < 128) {
+        } else if (c < 128 && !iscntrl(c)) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
@@ -500,54 +5202,239 @@ char *editorPrompt(char *prompt) {
             buf[buflen++] = c;
             buf[buflen] = '\0';
         }
+        if (callback) callback(buf, c);
+    }
+}
+
+// カーソル(rx)が表示範囲 [coloff, coloff + width) に入るよう横スクロールする
+void editorScroll(int width) {
+    if (E.rx < E.coloff) E.coloff = E.rx;
+    if (E.rx >= E.coloff + width) E.coloff = E.rx - width + 1;
+}
+
+// 表示カラム [coloff, coloff + width) に収まる部分だけを書き出す
+// 端末へ送る量は行の長さではなく画面幅で抑えられる
+void editorDrawRowSlice(struct abuf *ab, rownum at, int width) {
+    int col;
+    int j = editorRxToCx(at, E.coloff, &col);
+    erow tmp;
+    erow *row = editorRowGet(at, &tmp);
+    if (col < E.coloff && j < row->len) {
+        // 左端で全角文字が半分欠ける場合は空白で埋める
+        int w;
+        j += editorRowCharAt(row, j, &w);
+        col += w;
+        for (int k = E.coloff; k < col; k++) abAppend(ab, " ", 1);
+    }
+
+    int start = j;
+    while (j < row->len) {
+        int w;
+        int clen = editorRowCharAt(row, j, &w);
+        if (col + w > E.coloff + width) break;
+        col += w;
+        j += clen;
+    }
+    if (j == start) return;
+
+    const char *a, *b;
+    int alen, blen;
+    editorRowSpans(row, &a, &alen, &b, &blen);
+    if (start < alen) {
+        int end = j < alen ? j : alen;
+        abAppend(ab, &a[start], end - start);
+    }
+    if (j > alen) {
+        int from = start > alen ? start - alen : 0;
+        abAppend(ab, &b[from], j - alen - from);
+    }
+}
+
+// --- 差分描画 ---
+// 最後に描いた行 (E.painted) とこれから描く行 (E.frame) を比べ、
+// 変わった部分だけを書き換える最小のエスケープシーケンスを送る
+
+// カーソルをカラム from から to へ動かす (短く済む方を選ぶ)
+void editorMoveTo(struct abuf *ob, int from, int to) {
+    char seq[32];
+    if (to == from) return;
+    if (to == 0) {
+        abAppend(ob, "\r", 1);
+    } else if (to == from - 1) {
+        abAppend(ob, "\b", 1);
+    } else {
+        int rel = snprintf(seq, sizeof(seq), to > from ? "\x1b[%dC" : "\x1b[%dD",
+                           to > from ? to - from : from - to);
+        char abs[32];
+        int abslen = snprintf(abs, sizeof(abs), "\r\x1b[%dC", to);
+        if (abslen < rel) abAppend(ob, abs, abslen);
+        else abAppend(ob, seq, rel);
+    }
+}
+
+void editorPaint(int cursor) {
+    struct abuf *ob = &E.ob;
+    const char *nw = E.frame.b, *old = E.painted.b;
+    int nlen = E.frame.len, olen = E.painted.len;
+    ob->len = 0;
+
+    if (!E.painted_valid) {
+        abAppend(ob, "\r\x1b[?25l", 7); // カーソル隠す
+        abAppend(ob, "\x1b[K", 3);      // 行消去
+        if (nlen) abAppend(ob, nw, nlen);
+        editorMoveTo(ob, editorStrWidth(nw, nlen), cursor);
+        abAppend(ob, "\x1b[?25h", 6); // カーソル表示
+    } else {
+        // 先頭と末尾の共通部分を文字境界にそろえて取り除く
+        int p = 0;
+        while (p < nlen && p < olen && nw[p] == old[p]) p++;
+        if (p == nlen && p == olen) {
+            // 内容が同じならカーソル移動だけ
+            editorMoveTo(ob, E.painted_cx, cursor);
+        } else {
+            while (p > 0 && ((p < nlen && is_utf8_continuation(nw[p])) ||
+                             (p < olen && is_utf8_continuation(old[p])))) p--;
+            int s = 0;
+            while (s < nlen - p && s < olen - p && nw[nlen - 1 - s] == old[olen - 1 - s]) s++;
+            while (s > 0 && is_utf8_continuation(nw[nlen - s])) s--;
+
+            int colp = editorStrWidth(nw, p);
+            int wx = editorStrWidth(&old[p], olen - s - p);
+            int wy = editorStrWidth(&nw[p], nlen - s - p);
+            int wnew = colp + editorStrWidth(&nw[p], nlen - p);
+            int wold = colp + editorStrWidth(&old[p], olen - p);
+
+            // 案A: 変化点から行末まで書き直す
+            int costa = nlen - p + (wold > wnew ? 3 : 0);
+            // 案B: 文字の挿入/削除 (ICH/DCH) で後ろをずらし、変化した部分だけ書く
+            int costb = s > 0 ? nlen - s - p + (wy != wx ? 6 : 0) : INT_MAX;
+
+            editorMoveTo(ob, E.painted_cx, colp);
+            int at;
+            if (costb < costa) {
+                char seq[32];
+                if (wy > wx) abAppend(ob, seq, snprintf(seq, sizeof(seq), "\x1b[%d@", wy - wx));
+                else if (wy < wx) abAppend(ob, seq, snprintf(seq, sizeof(seq), "\x1b[%dP", wx - wy));
+                abAppend(ob, &nw[p], nlen - s - p);
+                at = colp + wy;
+            } else {
+                abAppend(ob, &nw[p], nlen - p);
+                if (wold > wnew) abAppend(ob, "\x1b[K", 3);
+                at = wnew;
+            }
+            editorMoveTo(ob, at, cursor);
+        }
     }
+    tty_write(ob->b, ob->len);
+
+    // 描いた内容を覚えておく (バッファは入れ替えて使い回す)
+    struct abuf tmp = E.painted;
+    E.painted = E.frame;
+    E.frame = tmp;
+    E.painted_cx = cursor;
+    E.painted_valid = 1;
 }
 
 void editorRefreshLine() {
-    struct abuf ab = ABUF_INIT;
+    E.frame.len = 0;
 
+    // パイプ受信中・追従中は行数の後ろに + を付ける。欄モードでは今の欄を添える
+    char more[128], saving[24] = "", column[48];
+    editorColumnStatus(column, sizeof(column));
+    if (E.save_pid > 0) {
+        int pct = editorSavePercent();
+        if (pct >= 0) snprintf(saving, sizeof(saving), " saving %d%%", pct);
+        else snprintf(saving, sizeof(saving), " saving");
+    }
+    snprintf(more, sizeof(more), "%s%s%s%s%s", E.stream_fd != -1 || E.follow ? "+" : "", column, saving,
+             E.notice[0] ? " " : "", E.notice);
+    char status[224];
     if (E.cy >= E.numrows) {
-         abAppend(&ab, "\r\x1b[K[EOF]", 8);
-         abAppend(&ab, "\r", 1);
-         tty_write(ab.b, ab.len);
-         abFree(&ab);
+         if (E.stream_fd == -1 && !E.follow) {
+             abAppend(&E.frame, "[EOF]", 5);
+         } else {
+             snprintf(status, sizeof(status), "[%lld/%lld%s] ", E.rowbase + E.numrows,
+                      E.rowbase + E.numrows, more);
+             abAppend(&E.frame, status, strlen(status));
+         }
+         editorPaint(E.frame.len);
          return;
     }
 
-    erow *row = &E.row[E.cy];
-    char status[32];
-    snprintf(status, sizeof(status), "[%d/%d] ", E.cy + 1, E.numrows);
+    if (E.filter && E.filter->building) {
+        snprintf(status, sizeof(status), "[hit ?/?, line %lld/%lld%s] ", E.rowbase + E.cy + 1,
+                 E.rowbase + E.numrows, more);
+    } else if (E.filter) {
+        snprintf(status, sizeof(status), "[hit %lld/%lld, line %lld/%lld%s] ", editorFilterRank(E.cy + 1),
+                 editorFilterHits(), E.rowbase + E.cy + 1, E.rowbase + E.numrows, more);
+    } else {
+        snprintf(status, sizeof(status), "[%lld/%lld%s] ", E.rowbase + E.cy + 1,
+                 E.rowbase + E.numrows, more);
+    }
     int status_len = strlen(status);
+    int status_width = editorStrWidth(status, status_len);  // 欄の名前は全角のこともある
 
-    abAppend(&ab, "\r\x1b[?25l", 8); // カーソル隠す
-    abAppend(&ab, "\x1b[K", 3);      // 行消去
-    abAppend(&ab, status, status_len);
-    abAppend(&ab, row->chars, row->len);
-
-    // カーソルのレンダリング位置を計算
-    E.rx = editorRowCxToRx(row, E.cx);
+    // カーソルのレンダリング位置を計算し、表示範囲を決める
+    // (最終カラムに書くと自動折り返しが起きるので1桁残す)
+    E.rx = editorCxToRx(E.cy, E.cx);
+    int width = E.screencols - status_width - 1;
+    if (width < 1) width = 1;
+    editorScroll(width);
 
-    // カーソル移動 (\rで先頭に戻っているので、status_len + rx 分だけ右へ)
-    if (status_len + E.rx > 0) {
-        char move_cursor[32];
-        snprintf(move_cursor, sizeof(move_cursor), "\r\x1b[%dC", status_len + E.rx);
-        abAppend(&ab, move_cursor, strlen(move_cursor));
-    } else {
-        abAppend(&ab, "\r", 1);
-    }
+    abAppend(&E.frame, status, status_len);
+    editorDrawRowSlice(&E.frame, E.cy, width);
 
-    abAppend(&ab, "\x1b[?25h", 6); // カーソル表示
+    // カーソルは状態表示の幅 + 表示上の位置 のカラムへ
+    editorPaint(status_width + E.rx - E.coloff);
+}
 
-    tty_write(ab.b, ab.len);
-    abFree(&ab);
+// 行も絞り込みの状態も変えないキー。裏で絞り込みを作っている間も待たずに処理できる
+int editorKeyIsMotion(int c) {
+    switch (c) {
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+        case CTRL_KEY('a'):
+        case CTRL_KEY('e'):
+        case CTRL_KEY('g'):
+        case CTRL_KEY('b'):
+        case CTRL_KEY('f'):
+        case CTRL_KEY('o'):
+        case BACKTAB_KEY:
+            return 1;
+        case '\t':
+            return E.columns;
+    }
+    return 0;
 }
 
 void editorProcessKeypress() {
     int c = editorReadKey();
+    if (c == NOTIFY_KEY) return;    // 絞り込みのビットマップができあがった (描き直すだけ)
+    E.notice[0] = '\0';
+    // 行を書き換えたり絞り込みを使ったりするキーなら、裏で行を読んでいるスレッドを待つ
+    if (!editorKeyIsMotion(c)) editorFilterFinish();
+    rownum oldcy = E.cy;
+    // 続けて打った文字はまとめて1回で元に戻す
+    int typing = c < 256 && !iscntrl(c);
+    editorJournalBegin(typing && E.step_typing);
+    E.step_typing = typing;
     switch (c) {
         case '\x1b': 
-            editorSave();
+            if (E.filename && !E.script) editorSaveAndExit();
+            if (editorSave() == -1) {
+                // 保存できなかった編集は記録に残す (次に開いたときに取り戻せる)
+                editorJournalSync();
+                // スクリプト実行では保存の失敗を終了ステータスで知らせる
+                if (E.script) exit(1);
+            } else {
+                editorJournalRemove();
+            }
             tty_write("\r\n", 2);
+            // 未着の入力を流し終えるまで端末を握らない
+            disableRawMode();
+            editorPassthrough();
             exit(0);
             break;
         case 127: 
@@ -562,7 +5449,10 @@ void editorProcessKeypress() {
             break;
         case CTRL_KEY('e'):
         case END_KEY:
-            if (E.cy < E.numrows) E.cx = E.row[E.cy].len;
+            if (E.cy < E.numrows) {
+                erow tmp;
+                E.cx = editorRowGet(E.cy, &tmp)->len;
+            }
             break;
         case CTRL_KEY('u'):
             editorDeleteToStart();
@@ -576,6 +5466,45 @@ void editorProcessKeypress() {
         case CTRL_KEY('g'):
             editorGoToLine();
             break;
+        case CTRL_KEY('b'):
+            editorJumpToKey();
+            break;
+        case CTRL_KEY('f'):
+            editorFind();
+            break;
+        case CTRL_KEY('r'):
+            editorReplace();
+            editorFilterRefresh();
+            break;
+        case CTRL_KEY('t'):
+            editorFilter();
+            break;
+        case CTRL_KEY('s'):
+            editorSaveBackground();
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+        case PASTE_KEY:
+            editorPaste();
+            break;
+        case CTRL_KEY('d'):
+            // パイプモード: カーソルより上の行を確定して下流へ送る
+            editorCommitRows(E.cy);
+            break;
+        case '\t':
+            // 欄モードでは次の欄へ (それ以外では今まで通り何もしない)
+            editorFieldMove(1);
+            break;
+        case BACKTAB_KEY:
+            editorFieldMove(-1);
+            break;
+        case CTRL_KEY('o'):
+            editorFieldJump();
+            break;
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
@@ -586,15 +5515,216 @@ void editorProcessKeypress() {
             if (!iscntrl(c)) editorInsertChar(c);
             break;
     }
+    // 編集された行の一致を調べ直す
+    editorFilterUpdate(oldcy);
+    editorFilterUpdate(E.cy);
+    editorAutoCommit();
 }
 
 void initEditor() {
     E.cx = 0;
     E.cy = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.root = lsNewNode(1);
+    E.hint = NULL;
+    E.hint_start = 0;
+    E.arena_next = E.arena_end = NULL;
+    memset(E.arena_free, 0, sizeof(E.arena_free));
+    pthread_mutex_init(&E.arena_lock, NULL);
     E.filename = NULL;
+    E.map = NULL;
+    E.maplen = 0;
+    E.mapcap = 0;
+    E.mapbase = 0;
+    E.rowbase = 0;
+    E.window = 0;
+    E.budget = (size_t)64 << 20;
+    E.spill_fd = -1;
+    E.spill_map = NULL;
+    E.spill_end = 0;
+    E.eol = EOL_LF;
+    E.index_cache = 1;
+    E.nul_off = SIZE_MAX;
+    E.bad_rows = 0;
+    E.bad_line = 0;
+    E.ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (E.ncpu < 1) E.ncpu = 1;
+    E.src_fd = -1;
+    E.scanned = 0;
+    E.stream_fd = -1;
+    E.follow = 0;
+    E.follow_fd = -1;
+    E.follow_wd = -1;
+    E.dirty = 0;
+    E.notice[0] = '\0';
+    E.journal_path = NULL;
+    E.journal_fd = -1;
+    E.journal_end = 0;
+    E.journal_buf = (struct abuf)ABUF_INIT;
+    E.journal_unsynced = 0;
+    E.journal_mute = 1;     // 読み込みが終わるまでは記録しない
+    E.journal_synced = 0;
+    E.step_open = 0;
+    E.step_cy = 0;
+    E.step_cx = 0;
+    E.step_typing = 0;
+    E.undo_steps = NULL;
+    E.undo_n = E.undo_done = E.undo_cap = 0;
+    E.save_pid = -1;
+    E.save_fd = -1;
+    E.save_done = 0;
+    E.save_mark = 0;
+    E.save_dirty = 0;
+    E.save_result = 0;
+    E.columns = 0;
+    E.col_delim = 0;
+    for (int i = 0; i < FIELD_CACHE; i++) E.fields[i] = (struct fieldcache){-1, 0, 0, 0, NULL};
+    E.fields_gen = 0;
+    E.col_head = (struct fieldcache){-1, 0, 0, 0, NULL};
+    E.col_header = NULL;
+    E.col_headerlen = 0;
+    E.col_last = -1;
+    E.goto_line = -1;
+    E.key_field = 0;
+    E.key_delim = 0;
+    E.in_prompt = 0;
+    E.prompt_info[0] = '\0';
+    E.prompt_row = -1;
+    E.prompt_col = 0;
+    E.prompt_enter = 0;
+    E.search = NULL;
+    E.notify_pipe[0] = E.notify_pipe[1] = -1;
+    E.find_cx = 0;
+    E.find_cy = 0;
+    E.filter = NULL;
+    E.coloff = 0;
+    E.marks_line = -1;
+    E.nmarks = 0;
+    E.marks_cap = 0;
+    E.marks = NULL;
+    E.screencols = 80;
+    E.winch = 0;
+    E.map_lost = 0;
+    E.pagesize = sysconf(_SC_PAGESIZE);
+    E.frame = (struct abuf)ABUF_INIT;
+    E.painted = (struct abuf)ABUF_INIT;
+    E.ob = (struct abuf)ABUF_INIT;
+    E.painted_cx = 0;
+    E.painted_valid = 0;
+    E.inlen = 0;
+    E.inpos = 0;
+    E.paste = NULL;
+    E.pastelen = 0;
+    E.pastecap = 0;
     E.tty_fd = -1;
+    E.script = NULL;
+    E.scriptlen = E.scriptpos = 0;
+}
+
+// --- スクリプト実行 (--script) ---
+// 端末なしで、スクリプトに書いたキー入力を editorProcessKeypress にそのまま流す。
+// 編集状態 E はプロセスに1つなので、複数のファイルは fork したプロセスで並列に処理する
+
+// スクリプトのエスケープを解く (その場で書き換えて長さを返す)。
+// \e はESC、\n と \r は Enter、\t はタブ、\cX は Ctrl+X、\xHH は任意のバイト。
+// 書きやすいよう、エスケープしていない改行は無視する
+size_t editorDecodeScript(char *s, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (c == '\n') continue;
+        if (c == '\\' && i + 1 < len) {
+            c = s[++i];
+            switch (c) {
+                case 'e': c = '\x1b'; break;
+                case 'n':
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'c':
+                    if (i + 1 < len) c = s[++i] & 0x1f;
+                    break;
+                case 'x': {
+                    int v = 0, k = 0;
+                    while (k < 2 && i + 1 < len && isxdigit((unsigned char)s[i + 1])) {
+                        char h = s[++i];
+                        v = v * 16 + (isdigit((unsigned char)h) ? h - '0' : (tolower((unsigned char)h) - 'a' + 10));
+                        k++;
+                    }
+                    c = v;
+                    break;
+                }
+            }
+        }
+        s[n++] = c;
+    }
+    return n;
+}
+
+// filename (NULLならパイプ) をスクリプトで編集する。最後は ESC と同じく保存して終了する
+void editorScriptOne(char *filename, rownum start_line) {
+    // 無いファイルを作ってしまわない (展開されなかったワイルドカードなど)
+    if (filename && access(filename, F_OK) == -1) {
+        fprintf(stderr, "slit: %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    editorOpen(filename);
+    // パイプは最後まで受け取ってから再生する (結果が到着のタイミングに左右されないように)
+    while (E.stream_fd != -1) {
+        struct pollfd pfd = {E.stream_fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) die("poll");
+        editorIngest();
+    }
+    if (start_line > 0) E.cy = start_line < E.numrows ? start_line : E.numrows - 1;
+    // 元に戻す (Ctrl+Z) のためだけに記録する (ファイルの横には置かない)
+    E.journal_mute--;
+    while (1) editorProcessKeypress();
+}
+
+// path のスクリプトを files のそれぞれに適用する。失敗したファイルがあれば1を返す
+int editorRunScript(const char *path, char **files, int nfiles, rownum start_line) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) die(path);
+    struct abuf ab = ABUF_INIT;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) abAppend(&ab, buf, n);
+    if (n == -1) die(path);
+    close(fd);
+    // 空のスクリプトでも端末からは読まない
+    E.script = ab.b ? ab.b : "";
+    E.scriptlen = ab.len ? editorDecodeScript(ab.b, ab.len) : 0;
+    E.scriptpos = 0;
+
+    if (nfiles <= 1) editorScriptOne(nfiles ? files[0] : NULL, start_line);
+
+    // 同時に E.ncpu 個までのプロセスで1ファイルずつ処理する
+    pid_t *pids = malloc(sizeof(pid_t) * nfiles);
+    if (!pids) die("malloc");
+    int next = 0, running = 0, failed = 0;
+    fflush(NULL);
+    while (next < nfiles || running > 0) {
+        if (next < nfiles && running < E.ncpu) {
+            pid_t pid = fork();
+            if (pid == -1) die("fork");
+            if (pid == 0) editorScriptOne(files[next], start_line);
+            pids[next++] = pid;
+            running++;
+            continue;
+        }
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            die("wait");
+        }
+        running--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) continue;
+        failed = 1;
+        for (int i = 0; i < next; i++)
+            if (pids[i] == pid) fprintf(stderr, "slit: %s: script failed\n", files[i]);
+    }
+    free(pids);
+    return failed;
 }
 
 void print_help() {
@@ -603,6 +5733,17 @@ void print_help() {
     printf("Options:\n");
     printf("  +<line>         Start editing at specific line number (0-indexed logic, but usage is usually 1-based)\n");
     printf("  <line>          Start editing at specific line number (if argument is purely numeric)\n");
+    printf("  -w, --window=N  Pipe mode: send lines more than N above the cursor downstream\n");
+    printf("  -b, --budget=SIZE  Pipe mode: keep at most SIZE bytes of input in memory and\n");
+    printf("                  spill the rest to a temporary file (default 64M, 0 = no limit)\n");
+    printf("  -k, --key-field=N  Ctrl+B compares the N-th field instead of the whole line\n");
+    printf("  -t, --key-delim=C  Fields are separated by C instead of blanks\n");
+    printf("  -c, --columns   Treat lines as CSV/TSV records (delimiter from -t or guessed\n");
+    printf("                  from the first line, which also names the columns)\n");
+    printf("  --script=FILE   Apply the keystrokes in FILE without a terminal, then save\n");
+    printf("                  and exit. Several files are processed in parallel\n");
+    printf("  -f, --follow    Keep reading lines appended to FILE while editing (like tail -F)\n");
+    printf("  --no-index-cache  Do not read or write the line index cache for large files\n");
     printf("  -h, --help      Show this help message\n");
     printf("  -v, --version   Show version information\n");
     printf("\n");
@@ -612,6 +5753,15 @@ void print_help() {
     printf("  Ctrl+U / Ctrl+K: Delete to start/end of line\n");
     printf("  Ctrl+W: Delete previous word\n");
     printf("  Ctrl+G: Go to line number\n");
+    printf("  Ctrl+B: Jump to the first line whose key is >= the input (sorted files)\n");
+    printf("  Ctrl+F: Incremental search (Up/Down: previous/next match, Esc: cancel)\n");
+    printf("  Ctrl+T: Filter: Up/Down move between lines containing a string (empty: off)\n");
+    printf("  Ctrl+R: Regex replace (y/n: this match, a: all remaining, q: stop)\n");
+    printf("  Ctrl+Z / Ctrl+Y: Undo / redo\n");
+    printf("  Ctrl+S: Save in the background and keep editing\n");
+    printf("  Ctrl+D: Pipe mode: send the lines above the cursor downstream\n");
+    printf("  Tab / Shift+Tab: Columns mode: next/previous field\n");
+    printf("  Ctrl+O: Columns mode: go to a field by number or column name\n");
     printf("  ESC: Save and Quit\n");
     printf("\n");
     printf("Examples:\n");
@@ -619,6 +5769,9 @@ void print_help() {
     printf("  slit +10 config.json   Edit starting at line 10\n");
     printf("  slit 10 config.json    Edit starting at line 10\n");
     printf("  ls | slit              Edit pipeline stream\n");
+    printf("  slit -f app.log        Watch a growing log\n");
+    printf("  slit -c data.csv       Edit a CSV file field by field\n");
+    printf("  slit --script=fix.keys *.conf   Apply the same edit to many files\n");
 }
 
 void print_version() {
@@ -627,6 +5780,18 @@ void print_version() {
     printf("License: MIT\n");
 }
 
+// "64M" のようなサイズ指定をバイト数にする (K/M/G 接尾辞)
+size_t parse_size(const char *str) {
+    char *end;
+    unsigned long long val = strtoull(str, &end, 10);
+    switch (toupper((unsigned char)*end)) {
+        case 'G': val <<= 10; /* fall through */
+        case 'M': val <<= 10; /* fall through */
+        case 'K': val <<= 10; break;
+    }
+    return (size_t)val;
+}
+
 int is_numeric(const char *str) {
     if (!str || *str == '\0') return 0;
     while (*str) {
@@ -637,17 +5802,30 @@ int is_numeric(const char *str) {
 }
 
 int main(int argc, char *argv[]) {
-    // ロケール設定（wcwidthのため）
+    // ロケール設定
     setlocale(LC_ALL, "");
 
     initEditor();
+    registerBusHandler();
 
-    int start_line = 0;
+    rownum start_line = 0;
     char *filename = NULL;
+    char *script = NULL;
+    // --script では全部のファイルを処理する
+    char **files = malloc(sizeof(char *) * argc);
+    int nfiles = 0;
 
     static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
         {"version", no_argument, 0, 'v'},
+        {"window", required_argument, 0, 'w'},
+        {"budget", required_argument, 0, 'b'},
+        {"key-field", required_argument, 0, 'k'},
+        {"key-delim", required_argument, 0, 't'},
+        {"no-index-cache", no_argument, 0, 'N'},
+        {"script", required_argument, 0, 'S'},
+        {"follow", no_argument, 0, 'f'},
+        {"columns", no_argument, 0, 'c'},
         {0, 0, 0, 0}
     };
 
@@ -663,7 +5841,7 @@ int main(int argc, char *argv[]) {
     // Note: getopt rearranges argv.
 
     while (1) {
-        opt = getopt_long(argc, argv, "hv", long_options, &option_index);
+        opt = getopt_long(argc, argv, "hvw:b:k:t:fc", long_options, &option_index);
         if (opt == -1) break;
 
         switch (opt) {
@@ -673,6 +5851,31 @@ int main(int argc, char *argv[]) {
             case 'v':
                 print_version();
                 exit(0);
+            case 'w':
+                E.window = atoll(optarg);
+                break;
+            case 'b':
+                E.budget = parse_size(optarg);
+                break;
+            case 'k':
+                E.key_field = atoi(optarg);
+                break;
+            case 't':
+                // \t はタブとして受け付ける
+                E.key_delim = strcmp(optarg, "\\t") == 0 ? '\t' : (unsigned char)optarg[0];
+                break;
+            case 'N':
+                E.index_cache = 0;
+                break;
+            case 'S':
+                script = optarg;
+                break;
+            case 'f':
+                E.follow = 1;
+                break;
+            case 'c':
+                E.columns = 1;
+                break;
             case '?':
                 // getopt_long prints error message automatically
                 exit(1);
@@ -683,7 +5886,7 @@ int main(int argc, char *argv[]) {
     for (int i = optind; i < argc; i++) {
         char *arg = argv[i];
         if (arg[0] == '+') {
-            start_line = atoi(arg + 1);
+            start_line = atoll(arg + 1);
             if (start_line > 0) start_line--;
         } else if (is_numeric(arg)) {
             // Check if it's a line number (pure numeric)
@@ -701,7 +5904,7 @@ int main(int argc, char *argv[]) {
 
             // Heuristic:
             // Store potential filename and potential line number.
-            int val = atoi(arg);
+            rownum val = atoll(arg);
             // If we already have a filename, this must be line number (or vice versa)
             if (filename) {
                 // We have a file, this is likely line number
@@ -721,18 +5924,38 @@ int main(int argc, char *argv[]) {
                         if (val > 0) start_line = val - 1;
                     } else {
                         filename = arg;
+                        files[nfiles++] = arg;
                     }
                 }
             }
         } else {
             filename = arg;
+            files[nfiles++] = arg;
         }
     }
 
+    // 端末を使わずにスクリプトで編集する
+    if (script) return editorRunScript(script, files, nfiles, start_line);
+
     // ★ここでファイルかパイプかを判断し、/dev/tty を開く
     
     // データ読み込み
+    // パイプは元から届いた分を追っていくので --follow は要らない
+    if (!filename) E.follow = 0;
     editorOpen(filename); 
+    E.dirty = 0;
+    if (E.follow) {
+        if (E.src_fd == -1) {
+            fprintf(stderr, "slit: %s: --follow needs an existing regular file\n", filename);
+            exit(1);
+        }
+        editorFollowWatch();
+    }
+    // 不正なUTF-8は開けるが場所を知らせておく (編集画面の上に残る)
+    if (E.bad_rows > 0) {
+        fprintf(stderr, "slit: warning: invalid UTF-8 on line %lld (%lld line%s affected)\n",
+                E.bad_line + 1, E.bad_rows, E.bad_rows > 1 ? "s" : "");
+    }
 
     // UI制御用の端末を開く
     // /dev/tty はカレントプロセスの制御端末を指す特殊ファイル
@@ -747,15 +5970,25 @@ int main(int argc, char *argv[]) {
 
     enableRawMode();
     registerSignalHandlers();
+    editorUpdateWindowSize();
     
-    if (start_line > 0 && start_line < E.numrows) {
+    if (E.stream_fd != -1) {
+        // パイプ受信中は指定行が届くのを待ってから移動する
+        if (start_line > 0) E.goto_line = start_line;
+    } else if (start_line > 0 && start_line < E.numrows) {
         E.cy = start_line;
     } else if (start_line >= E.numrows) {
         E.cy = E.numrows - 1;
     }
 
+    // 編集はファイルの横に記録しておき、前回保存せずに終わった分があれば取り戻す
+    if (filename) E.journal_path = editorJournalPath(filename);
+    editorJournalRecover();
+    E.journal_mute--;
+
     while (1) {
-        editorRefreshLine();
+        // 入力が溜まっている間は描画を後回しにする (貼り付けや高速なキーリピート対策)
+        if (!editorInputPending()) editorRefreshLine();
         editorProcessKeypress();
     }
     return 0;